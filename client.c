@@ -2,9 +2,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <stdint.h>
 #include <time.h>
 
 #define SERVER_ADDRESS "127.0.0.1"
@@ -12,8 +14,26 @@
 #define BUFFER_SIZE 1024
 #define CLIENT_ID 1
 
+// Wire encodings; see the matching definitions in server.c. Start the client
+// with --binary to negotiate fixed-offset binary frames at logon.
+#define ENCODING_TEXT 0
+#define ENCODING_BINARY 1
+
+#define BINARY_TEMPLATE_NEW_ORDER_SINGLE 1
+#define BINARY_TEMPLATE_ORDER_CANCEL_REQUEST 2
+#define BINARY_TEMPLATE_EXECUTION_REPORT 3
+#define BINARY_TEMPLATE_MARKET_DATA_REQUEST 4
+#define BINARY_TEMPLATE_MARKET_DATA 5
+#define BINARY_TEMPLATE_ORDER_MASS_CANCEL_REQUEST 6
+#define BINARY_TEMPLATE_ORDER_MASS_CANCEL_REPORT 7
+#define BINARY_TEMPLATE_TEST_REQUEST 8
+#define BINARY_TEMPLATE_HEARTBEAT 9
+
+#define BINARY_PRICE_SCALE 10000
+
 int clientSeqNum = 1;
 char compId[10] = "CLIENT1";
+int wireEncoding = ENCODING_TEXT;
 
 typedef struct {
     char clOrdId[20];
@@ -42,6 +62,88 @@ typedef struct {
     char clOrdId[20];
 } OrderCancelRequest;
 
+typedef struct {
+    char instrument[20];    // "ALL" cancels every instrument
+    char side[5];           // "BUY", "SELL" or "ANY"
+} OrderMassCancelRequest;
+
+typedef struct {
+    uint16_t blockLength;
+    uint16_t templateId;
+    uint32_t seqNum;
+} BinaryHeader;
+
+typedef struct {
+    BinaryHeader header;
+    char clOrdId[20];
+    char instrument[20];
+    uint8_t side;           // FIX 54: '1' = buy, '2' = sell
+    uint8_t padding[3];
+    int32_t quantity;
+    int64_t price;
+} BinaryNewOrderSingle;
+
+typedef struct {
+    BinaryHeader header;
+    char clOrdId[20];
+    uint8_t padding[4];
+} BinaryOrderCancelRequest;
+
+typedef struct {
+    BinaryHeader header;
+    char clOrdId[20];
+    char instrument[20];
+    uint8_t side;
+    uint8_t ordStatus;      // FIX 39: '0' = new, '2' = filled, '4' = canceled, '8' = rejected
+    uint8_t padding[2];
+    int32_t quantity;
+    int64_t price;
+} BinaryExecutionReport;
+
+typedef struct {
+    BinaryHeader header;
+    char instrument[20];
+    uint8_t padding[4];
+    int64_t lastPx;         // negative if the instrument is unknown
+} BinaryMarketData;
+
+typedef struct {
+    BinaryHeader header;
+    char instrument[20];
+    uint8_t massCancelRequestType;  // FIX 530: '1' = by instrument, '7' = all
+    uint8_t side;           // '1' = buy, '2' = sell, 0 = both
+    uint8_t padding[2];
+} BinaryOrderMassCancelRequest;
+
+typedef struct {
+    BinaryHeader header;
+    uint8_t massCancelResponse;     // FIX 531: request type echoed, '0' = rejected
+    uint8_t padding[3];
+    int32_t totalAffectedOrders;
+} BinaryOrderMassCancelReport;
+
+typedef struct {
+    BinaryHeader header;
+    char testReqId[20];
+    uint8_t padding[4];
+} BinaryTestRequest;
+
+typedef struct {
+    BinaryHeader header;
+    char testReqId[20];     // echoes the TestRequest being answered, else empty
+    uint8_t padding[4];
+} BinaryHeartbeat;
+
+_Static_assert(sizeof(BinaryHeader) == 8, "BinaryHeader layout changed");
+_Static_assert(sizeof(BinaryNewOrderSingle) == 64, "BinaryNewOrderSingle layout changed");
+_Static_assert(sizeof(BinaryOrderCancelRequest) == 32, "BinaryOrderCancelRequest layout changed");
+_Static_assert(sizeof(BinaryExecutionReport) == 64, "BinaryExecutionReport layout changed");
+_Static_assert(sizeof(BinaryMarketData) == 40, "BinaryMarketData layout changed");
+_Static_assert(sizeof(BinaryOrderMassCancelRequest) == 32, "BinaryOrderMassCancelRequest layout changed");
+_Static_assert(sizeof(BinaryOrderMassCancelReport) == 16, "BinaryOrderMassCancelReport layout changed");
+_Static_assert(sizeof(BinaryTestRequest) == 32, "BinaryTestRequest layout changed");
+_Static_assert(sizeof(BinaryHeartbeat) == 32, "BinaryHeartbeat layout changed");
+
 void generateSendingTime(char* timeStr, size_t size) {
     time_t now = time(NULL);
     struct tm* tm_info = localtime(&now);
@@ -90,17 +192,14 @@ void formatNewOrderSingle(const NewOrderSingle* order, char* message) {
     snprintf(message + strlen(message), BUFFER_SIZE - strlen(message), "10=%03d|", checksum);
 }
 
+// The server binds a connection to a session only on its own tag=value Logon,
+// whichever encoding the session goes on to use.
 void formatLogonMessage(char* message) {
-    char sendingTime[21];
-    generateSendingTime(sendingTime, sizeof(sendingTime));
-    snprintf(message, BUFFER_SIZE, "8=FIX.4.2|35=A|49=%s|56=SERVER|34=%d|52=%s|",
-            compId, clientSeqNum++, sendingTime);
-    int checksum = 0;
-    for (char *p = message; *p; p++) {
-        checksum += (unsigned char)*p;
+    snprintf(message, BUFFER_SIZE, "CompID=%s|ServerSeqNum=0|ClientSeqNum=%d|MsgType=Logon|",
+            compId, clientSeqNum++);
+    if (wireEncoding == ENCODING_BINARY) {
+        snprintf(message + strlen(message), BUFFER_SIZE - strlen(message), "Encoding=BINARY|");
     }
-    checksum %= 256;
-    snprintf(message + strlen(message), BUFFER_SIZE - strlen(message), "10=%03d|", checksum);
 }
 
 void sendFIXMessage(int clientSocket, const char* message, FILE* logFile) {
@@ -150,6 +249,129 @@ int parseOrderCancelReject(const char* message, OrderCancelReject* reject) {
            reject->clOrdId, reject->origClOrdId, reject->ordStatus);
 }
 
+void sendBinaryMessage(int clientSocket, BinaryHeader* header, size_t size, uint16_t templateId, FILE* logFile) {
+    header->blockLength = (uint16_t)(size - sizeof(BinaryHeader));
+    header->templateId = templateId;
+    header->seqNum = (uint32_t)clientSeqNum++;
+    ssize_t bytesSent = send(clientSocket, header, size, 0);
+    if (bytesSent < 0) {
+        perror("Error in sending data");
+        exit(EXIT_FAILURE);
+    }
+    char logMessage[64];
+    snprintf(logMessage, sizeof(logMessage), "Sent binary message template=%u seq=%u", templateId, header->seqNum);
+    writeLog(logFile, logMessage);
+}
+
+void sendBinaryNewOrderSingle(int clientSocket, const NewOrderSingle* order, FILE* logFile) {
+    BinaryNewOrderSingle request;
+    memset(&request, 0, sizeof(request));
+    snprintf(request.clOrdId, sizeof(request.clOrdId), "%d", clientSeqNum);
+    snprintf(request.instrument, sizeof(request.instrument), "%s", order->instrument);
+    request.side = (strcmp(order->side, "BUY") == 0 || strcmp(order->side, "1") == 0) ? '1' : '2';
+    request.quantity = order->quantity;
+    request.price = (int64_t)(order->price * BINARY_PRICE_SCALE + 0.5);
+    sendBinaryMessage(clientSocket, &request.header, sizeof(request), BINARY_TEMPLATE_NEW_ORDER_SINGLE, logFile);
+}
+
+void sendBinaryOrderCancelRequest(int clientSocket, const OrderCancelRequest* cancelRequest, FILE* logFile) {
+    BinaryOrderCancelRequest request;
+    memset(&request, 0, sizeof(request));
+    snprintf(request.clOrdId, sizeof(request.clOrdId), "%s", cancelRequest->clOrdId);
+    sendBinaryMessage(clientSocket, &request.header, sizeof(request), BINARY_TEMPLATE_ORDER_CANCEL_REQUEST, logFile);
+}
+
+void sendBinaryOrderMassCancelRequest(int clientSocket, const OrderMassCancelRequest* massCancelRequest, FILE* logFile) {
+    BinaryOrderMassCancelRequest request;
+    memset(&request, 0, sizeof(request));
+    if (strcmp(massCancelRequest->instrument, "ALL") == 0) {
+        request.massCancelRequestType = '7';
+    } else {
+        request.massCancelRequestType = '1';
+        snprintf(request.instrument, sizeof(request.instrument), "%s", massCancelRequest->instrument);
+    }
+    request.side = strcmp(massCancelRequest->side, "BUY") == 0 ? '1' : strcmp(massCancelRequest->side, "SELL") == 0 ? '2' : 0;
+    sendBinaryMessage(clientSocket, &request.header, sizeof(request), BINARY_TEMPLATE_ORDER_MASS_CANCEL_REQUEST, logFile);
+}
+
+void sendBinaryTestRequest(int clientSocket, FILE* logFile) {
+    BinaryTestRequest request;
+    memset(&request, 0, sizeof(request));
+    snprintf(request.testReqId, sizeof(request.testReqId), "%d", clientSeqNum);
+    sendBinaryMessage(clientSocket, &request.header, sizeof(request), BINARY_TEMPLATE_TEST_REQUEST, logFile);
+}
+
+void sendBinaryHeartbeat(int clientSocket, const char* testReqId, FILE* logFile) {
+    BinaryHeartbeat heartbeat;
+    memset(&heartbeat, 0, sizeof(heartbeat));
+    snprintf(heartbeat.testReqId, sizeof(heartbeat.testReqId), "%s", testReqId);
+    sendBinaryMessage(clientSocket, &heartbeat.header, sizeof(heartbeat), BINARY_TEMPLATE_HEARTBEAT, logFile);
+}
+
+// Text replies (e.g. the logon acknowledgement) can still arrive on a binary
+// session, so only treat the buffer as binary if it starts with a valid frame.
+int isBinaryMessage(const char* message, ssize_t length) {
+    BinaryHeader header;
+    if (length < (ssize_t)sizeof(header)) {
+        return 0;
+    }
+    memcpy(&header, message, sizeof(header));
+    return header.templateId >= BINARY_TEMPLATE_NEW_ORDER_SINGLE &&
+           header.templateId <= BINARY_TEMPLATE_HEARTBEAT &&
+           (ssize_t)sizeof(header) + header.blockLength <= length;
+}
+
+void handleBinaryMessage(const char* message, ssize_t length, int clientSocket, FILE* logFile) {
+    ssize_t offset = 0;
+    while (length - offset >= (ssize_t)sizeof(BinaryHeader)) {
+        BinaryHeader header;
+        memcpy(&header, message + offset, sizeof(header));
+        ssize_t frameSize = (ssize_t)sizeof(BinaryHeader) + header.blockLength;
+        if (length - offset < frameSize) {
+            printf("Truncated binary message.\n");
+            return;
+        }
+
+        if (header.templateId == BINARY_TEMPLATE_EXECUTION_REPORT && frameSize == sizeof(BinaryExecutionReport)) {
+            BinaryExecutionReport report;
+            memcpy(&report, message + offset, sizeof(report));
+            printf("Received Execution Report: ClOrdId=%.20s, Symbol=%.20s, Side=%c, OrderQty=%d, OrdStatus=%c, Price=%.2f\n",
+                   report.clOrdId, report.instrument, report.side ? report.side : '-', report.quantity,
+                   report.ordStatus, (double)report.price / BINARY_PRICE_SCALE);
+            writeLog(logFile, "Received binary Execution Report");
+        } else if (header.templateId == BINARY_TEMPLATE_MARKET_DATA && frameSize == sizeof(BinaryMarketData)) {
+            BinaryMarketData marketData;
+            memcpy(&marketData, message + offset, sizeof(marketData));
+            if (marketData.lastPx >= 0) {
+                printf("Received Market Data: Instrument=%.20s, LastPx=%.2f\n",
+                       marketData.instrument, (double)marketData.lastPx / BINARY_PRICE_SCALE);
+            } else {
+                printf("Received Market Data: Instrument=%.20s not found\n", marketData.instrument);
+            }
+            writeLog(logFile, "Received binary Market Data");
+        } else if (header.templateId == BINARY_TEMPLATE_ORDER_MASS_CANCEL_REPORT && frameSize == sizeof(BinaryOrderMassCancelReport)) {
+            BinaryOrderMassCancelReport report;
+            memcpy(&report, message + offset, sizeof(report));
+            printf("Received Order Mass Cancel Report: MassCancelResponse=%c, TotalAffectedOrders=%d\n",
+                   report.massCancelResponse, report.totalAffectedOrders);
+            writeLog(logFile, "Received binary Order Mass Cancel Report");
+        } else if (header.templateId == BINARY_TEMPLATE_TEST_REQUEST && frameSize == sizeof(BinaryTestRequest)) {
+            BinaryTestRequest request;
+            memcpy(&request, message + offset, sizeof(request));
+            request.testReqId[sizeof(request.testReqId) - 1] = '\0';
+            sendBinaryHeartbeat(clientSocket, request.testReqId, logFile);
+        } else if (header.templateId == BINARY_TEMPLATE_HEARTBEAT && frameSize == sizeof(BinaryHeartbeat)) {
+            BinaryHeartbeat heartbeat;
+            memcpy(&heartbeat, message + offset, sizeof(heartbeat));
+            printf("Received Heartbeat: TestReqID=%.20s\n", heartbeat.testReqId);
+            writeLog(logFile, "Received binary Heartbeat");
+        } else {
+            printf("Unknown binary message template: %u\n", header.templateId);
+        }
+        offset += frameSize;
+    }
+}
+
 void requestMarketData(int clientSocket, const char* instrument) {
     char buffer[BUFFER_SIZE];
     sprintf(buffer, "CompID=CLIENT|ServerSeqNum=0|ClientSeqNum=0|MsgType=V|Instrument=%s|", instrument);
@@ -174,7 +396,19 @@ void handleIncomingMessage(const char* message, int clientSocket, FILE* logFile)
     int seqNum, newSeqNum;
 
     if (sscanf(message, "%*[^|]|35=%2[^|]", msgType) != 1) {
-        printf("Invalid message format.\n");
+        // The server's own tag=value replies; only the mass cancel report is parsed
+        const char* report = strstr(message, "|MsgType=r|");
+        char massCancelResponse[2];
+        int totalAffectedOrders;
+        if (report != NULL &&
+            sscanf(report, "|MsgType=r|MassCancelRequestType=%*[^|]|MassCancelResponse=%1[^|]|TotalAffectedOrders=%d|",
+                   massCancelResponse, &totalAffectedOrders) == 2) {
+            printf("Received Order Mass Cancel Report: MassCancelResponse=%s, TotalAffectedOrders=%d\n",
+                   massCancelResponse, totalAffectedOrders);
+        } else {
+            // Session-level replies such as the logon acknowledgement are plain text
+            printf("Received: %s\n", message);
+        }
         return;
     }
 
@@ -183,9 +417,13 @@ void handleIncomingMessage(const char* message, int clientSocket, FILE* logFile)
         writeLog(logFile, "Received Heartbeat message");
     } else if (strcmp(msgType, "1") == 0) {
         // This is a test request message, send a Heartbeat message back
-        char heartbeatMessage[BUFFER_SIZE] = {0};
-        formatHeartbeatMessage(heartbeatMessage);
-        sendFIXMessage(clientSocket, heartbeatMessage, logFile);
+        if (wireEncoding == ENCODING_BINARY) {
+            sendBinaryHeartbeat(clientSocket, "", logFile);
+        } else {
+            char heartbeatMessage[BUFFER_SIZE] = {0};
+            formatHeartbeatMessage(heartbeatMessage);
+            sendFIXMessage(clientSocket, heartbeatMessage, logFile);
+        }
     } else if (strcmp(msgType, "2") == 0) {
         // This is a Resend Request, handle appropriately
         if (sscanf(message, "%*[^|]|34=%d[^|]", &seqNum) != 1) {
@@ -250,11 +488,31 @@ void formatOrderCancelRequest(const OrderCancelRequest* request, char* message)
     snprintf(message + strlen(message), BUFFER_SIZE - strlen(message) - 1, "10=%03d|", checksum);
 }
 
+// Same tag=value fields the server reads: MassCancelRequestType (FIX 530)
+// is 7 for all instruments or 1 with an Instrument; Side is optional.
+void formatOrderMassCancelRequest(const OrderMassCancelRequest* request, char* message) {
+    snprintf(message, BUFFER_SIZE, "CompID=%s|ServerSeqNum=0|ClientSeqNum=%d|MsgType=q|",
+            compId, clientSeqNum++);
+    if (strcmp(request->instrument, "ALL") == 0) {
+        snprintf(message + strlen(message), BUFFER_SIZE - strlen(message), "MassCancelRequestType=7|");
+    } else {
+        snprintf(message + strlen(message), BUFFER_SIZE - strlen(message), "MassCancelRequestType=1|Instrument=%s|",
+                 request->instrument);
+    }
+    if (strcmp(request->side, "BUY") == 0 || strcmp(request->side, "SELL") == 0) {
+        snprintf(message + strlen(message), BUFFER_SIZE - strlen(message), "Side=%s|", request->side);
+    }
+}
+
 
-int main() {
+int main(int argc, char *argv[]) {
     int clientSocket;
     struct sockaddr_in serverAddr;
 
+    if (argc > 1 && strcmp(argv[1], "--binary") == 0) {
+        wireEncoding = ENCODING_BINARY;
+    }
+
     clientSocket = socket(AF_INET, SOCK_STREAM, 0);
     if (clientSocket < 0) {
         perror("Error in socket creation");
@@ -273,17 +531,7 @@ int main() {
     printf("Connected to the server.\n");
 
     char buffer[BUFFER_SIZE] = {0};
-    ssize_t bytesRead = recv(clientSocket, buffer, sizeof(buffer) - 1, 0);
-    if (bytesRead > 0) {
-        printf("%s", buffer);
-    } else if (bytesRead < 0) {
-        perror("Error in receiving data");
-        exit(EXIT_FAILURE);
-    } else {
-        printf("Server closed the connection.\n");
-        close(clientSocket);
-        exit(EXIT_SUCCESS);
-    }
+    ssize_t bytesRead;
 
     FILE* logFile = fopen("/Users/alpaltug/Desktop/code/staj'23/cboe/client.log", "w");
     if (logFile == NULL) {
@@ -292,18 +540,30 @@ int main() {
         exit(EXIT_FAILURE);
     }
 
-    // Send a logon message
+    // Send a logon message; the server says nothing until it arrives
     char logonMessage[BUFFER_SIZE] = {0};
     formatLogonMessage(logonMessage);
     sendFIXMessage(clientSocket, logonMessage, logFile);
 
+    bytesRead = recv(clientSocket, buffer, sizeof(buffer) - 1, 0);
+    if (bytesRead <= 0) {
+        perror("Error in receiving logon reply");
+        close(clientSocket);
+        exit(EXIT_FAILURE);
+    }
+    handleIncomingMessage(buffer, clientSocket, logFile);
+
     while (1) {
-        printf("> ");
+        // Pick up anything the server sent unprompted, e.g. a fill of a resting order
         memset(buffer, 0, sizeof(buffer));
-        bytesRead = recv(clientSocket, buffer, sizeof(buffer) - 1, 0);
-        if (bytesRead > 0) {
+        bytesRead = recv(clientSocket, buffer, sizeof(buffer) - 1, MSG_DONTWAIT);
+        if (bytesRead > 0 && wireEncoding == ENCODING_BINARY && isBinaryMessage(buffer, bytesRead)) {
+            handleBinaryMessage(buffer, bytesRead, clientSocket, logFile);
+        } else if (bytesRead > 0) {
             // Handle incoming message
             handleIncomingMessage(buffer, clientSocket, logFile);
+        } else if (bytesRead < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            // nothing pending
         } else if (bytesRead < 0) {
             perror("Error in receiving data");
             break;
@@ -322,9 +582,13 @@ int main() {
 
         if (strcmp(buffer, "testRequest") == 0) {
             // Send a test request message
-            char testRequestMessage[BUFFER_SIZE] = {0};
-            formatTestRequestMessage(testRequestMessage);
-            sendFIXMessage(clientSocket, testRequestMessage, logFile);
+            if (wireEncoding == ENCODING_BINARY) {
+                sendBinaryTestRequest(clientSocket, logFile);
+            } else {
+                char testRequestMessage[BUFFER_SIZE] = {0};
+                formatTestRequestMessage(testRequestMessage);
+                sendFIXMessage(clientSocket, testRequestMessage, logFile);
+            }
         } else if (strcmp(buffer, "orderCancelRequest") == 0) {
             // Send an order cancel request message
             printf("Please enter ClOrdId of the order to cancel: ");
@@ -339,9 +603,30 @@ int main() {
             strncpy(request.clOrdId, clOrdId, sizeof(request.clOrdId) - 1);
             request.clOrdId[sizeof(request.clOrdId) - 1] = '\0';
 
-            char orderCancelRequestMessage[BUFFER_SIZE] = {0};
-            formatOrderCancelRequest(&request, orderCancelRequestMessage);
-            sendFIXMessage(clientSocket, orderCancelRequestMessage, logFile);
+            if (wireEncoding == ENCODING_BINARY) {
+                sendBinaryOrderCancelRequest(clientSocket, &request, logFile);
+            } else {
+                char orderCancelRequestMessage[BUFFER_SIZE] = {0};
+                formatOrderCancelRequest(&request, orderCancelRequestMessage);
+                sendFIXMessage(clientSocket, orderCancelRequestMessage, logFile);
+            }
+        } else if (strcmp(buffer, "orderMassCancelRequest") == 0) {
+            // Cancel all of this session's orders, optionally for one instrument and side
+            printf("Please enter instrument (or ALL) and side (BUY, SELL or ANY): ");
+            OrderMassCancelRequest request;
+            if (scanf("%19s %4s", request.instrument, request.side) != 2) {
+                printf("Invalid input.\n");
+                continue;
+            }
+            getchar(); // consume newline
+
+            if (wireEncoding == ENCODING_BINARY) {
+                sendBinaryOrderMassCancelRequest(clientSocket, &request, logFile);
+            } else {
+                char orderMassCancelRequestMessage[BUFFER_SIZE] = {0};
+                formatOrderMassCancelRequest(&request, orderMassCancelRequestMessage);
+                sendFIXMessage(clientSocket, orderMassCancelRequestMessage, logFile);
+            }
         } else {
             NewOrderSingle order;
             if (parseNewOrderSingle(buffer, &order) != 4) {
@@ -349,17 +634,25 @@ int main() {
                 continue;
             }
 
-            formatNewOrderSingle(&order, buffer);
-            ssize_t bytesSent = send(clientSocket, buffer, strlen(buffer), 0);
-            if (bytesSent < 0) {
-                perror("Error in sending data");
-                break;
+            if (wireEncoding == ENCODING_BINARY) {
+                sendBinaryNewOrderSingle(clientSocket, &order, logFile);
+            } else {
+                formatNewOrderSingle(&order, buffer);
+                ssize_t bytesSent = send(clientSocket, buffer, strlen(buffer), 0);
+                if (bytesSent < 0) {
+                    perror("Error in sending data");
+                    break;
+                }
             }
         }
 
         memset(buffer, 0, sizeof(buffer));
         bytesRead = recv(clientSocket, buffer, sizeof(buffer) - 1, 0);
-        if (bytesRead > 0) {
+        if (bytesRead > 0 && wireEncoding == ENCODING_BINARY && isBinaryMessage(buffer, bytesRead)) {
+            // Binary frames are already logged by handleBinaryMessage
+            handleBinaryMessage(buffer, bytesRead, clientSocket, logFile);
+            continue;
+        } else if (bytesRead > 0) {
             handleIncomingMessage(buffer, clientSocket, logFile);
         } else if (bytesRead < 0) {
             perror("Error in receiving data");
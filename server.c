@@ -1,61 +1,337 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <poll.h>
+#include <sys/mman.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <signal.h>
+#include <stdint.h>
+#include <stdatomic.h>
 #include <time.h>
 
 #define SERVER_PORT 8080
 #define MAX_PENDING_REQUESTS 100
 #define MAX_MESSAGES 100
-#define MAX_ORDERS 100
 #define BUFFER_SIZE 1024
+#define MAX_EPOLL_EVENTS 64
+#define MAX_SESSIONS 4096
+#define SESSION_HASH_SIZE 8192      // power of two, kept at most half full
+#define MAX_FDS 65536
+#define COMP_ID_SIZE 32
+#define ORDER_POOL_SIZE 65536
+#define ACCEPT_BACKOFF_USEC 10000   // pause after accept fails for lack of descriptors
+
+// Wire encodings a session can negotiate at logon. Text is the default and
+// stays the only option for external counterparties; co-located clients add
+// "Encoding=BINARY|" to their Logon to switch to fixed-offset binary frames.
+#define ENCODING_TEXT 0
+#define ENCODING_BINARY 1
+
+// Binary template IDs (SBE-style: every frame is a BinaryHeader followed by a
+// fixed-size block, integers in little-endian host order).
+#define BINARY_TEMPLATE_NEW_ORDER_SINGLE 1
+#define BINARY_TEMPLATE_ORDER_CANCEL_REQUEST 2
+#define BINARY_TEMPLATE_EXECUTION_REPORT 3
+#define BINARY_TEMPLATE_MARKET_DATA_REQUEST 4
+#define BINARY_TEMPLATE_MARKET_DATA 5
+#define BINARY_TEMPLATE_ORDER_MASS_CANCEL_REQUEST 6
+#define BINARY_TEMPLATE_ORDER_MASS_CANCEL_REPORT 7
+#define BINARY_TEMPLATE_TEST_REQUEST 8
+#define BINARY_TEMPLATE_HEARTBEAT 9
+#define MAX_BINARY_FRAME_SIZE 64    // largest inbound template, header included
+
+// FIX 530 MassCancelRequestType values we support
+#define MASS_CANCEL_BY_INSTRUMENT '1'
+#define MASS_CANCEL_ALL '7'
+
+// Prices are held as integer ticks: price * PRICE_SCALE. Binary frames
+// carry the same fixed-point value, so they need no conversion.
+#define PRICE_SCALE 10000
+
+// Order sides use the FIX 54 values, as on the binary wire
+#define SIDE_BUY '1'
+#define SIDE_SELL '2'
+
+// Pre-trade risk. Limits and the set of tradable instruments are read from
+// RISK_CONFIG_FILE at startup and again on SIGHUP; a limit of 0 means "not
+// checked". An instrument not listed in the file is rejected.
+#define RISK_CONFIG_FILE "risk.conf"
+#define MAX_RISK_PROFILES 64
+#define MAX_INSTRUMENTS 256
+#define INSTRUMENT_HASH_SIZE 512    // power of two, kept at most half full
 
 int serverSocket;
-int serverSeqNum = 1;
 
+// A session is identified by its SenderCompID/TargetCompID pair and outlives
+// any one connection: sequence numbers, the journal and risk state are kept
+// when the counterparty disconnects and picked up again on its next Logon.
 typedef struct {
-    int clientId;
+    int clientId;           // socket of the current connection, -1 while disconnected
+    int sessionId;          // index into sessions[]
     int lastSeqNum;
-    char compId[10];
+    int nextOutSeqNum;      // ServerSeqNum of the next message sent to this session
+    char compId[COMP_ID_SIZE];
+    char targetCompId[COMP_ID_SIZE];
+    int encoding;
+    int cancelOnDisconnect;
+    int32_t orders;         // first of this session's resting orders (pool index), -1 = none
+    char pendingInput[MAX_BINARY_FRAME_SIZE];   // binary frame split across reads
+    int pendingLength;
     FILE* logFile;
+    int riskGeneration;     // generation of the limits riskProfile was resolved against
+    int riskProfile;        // index into RiskLimits.profiles, -1 for the default limits
+    long long rateWindowStart;
+    int rateWindowOrders;
 } ClientInfo;
 
-typedef struct NewOrderSingle {
+typedef struct {
+    int maxOrderQty;
+    double maxNotional;
+    int maxOrdersPerSec;
+    int maxPosition;
+} SessionLimits;
+
+typedef struct {
+    int maxOrderQty;
+    double priceBandPct;    // max deviation from the reference price, in percent
+    double referencePx;     // 0 = use the last traded price
+} InstrumentLimits;
+
+// One parse of the config file. Instruments are kept by name: only the
+// session thread assigns instrument IDs, when it adopts the table.
+typedef struct {
+    int generation;
+    SessionLimits defaultSession;
+    char profileCompIds[MAX_RISK_PROFILES][COMP_ID_SIZE];
+    SessionLimits profiles[MAX_RISK_PROFILES];
+    int profileCount;
+    char instrumentNames[MAX_INSTRUMENTS][20];
+    InstrumentLimits instruments[MAX_INSTRUMENTS];
+    int instrumentCount;
+} RiskLimits;
+
+typedef struct {
+    uint16_t blockLength;
+    uint16_t templateId;
+    uint32_t seqNum;
+} BinaryHeader;
+
+typedef struct {
+    BinaryHeader header;
+    char clOrdId[20];
+    char instrument[20];
+    uint8_t side;           // FIX 54: '1' = buy, '2' = sell
+    uint8_t padding[3];
+    int32_t quantity;
+    int64_t price;
+} BinaryNewOrderSingle;
+
+typedef struct {
+    BinaryHeader header;
+    char clOrdId[20];
+    uint8_t padding[4];
+} BinaryOrderCancelRequest;
+
+typedef struct {
+    BinaryHeader header;
+    char clOrdId[20];
+    char instrument[20];
+    uint8_t side;
+    uint8_t ordStatus;      // FIX 39: '0' = new, '2' = filled, '4' = canceled, '8' = rejected
+    uint8_t padding[2];
+    int32_t quantity;
+    int64_t price;
+} BinaryExecutionReport;
+
+typedef struct {
+    BinaryHeader header;
+    char instrument[20];
+    uint8_t padding[4];
+} BinaryMarketDataRequest;
+
+typedef struct {
+    BinaryHeader header;
+    char instrument[20];
+    uint8_t padding[4];
+    int64_t lastPx;         // negative if the instrument is unknown
+} BinaryMarketData;
+
+typedef struct {
+    BinaryHeader header;
+    char instrument[20];    // used with MASS_CANCEL_BY_INSTRUMENT
+    uint8_t massCancelRequestType;  // FIX 530
+    uint8_t side;           // '1' = buy, '2' = sell, 0 = both
+    uint8_t padding[2];
+} BinaryOrderMassCancelRequest;
+
+typedef struct {
+    BinaryHeader header;
+    uint8_t massCancelResponse;     // FIX 531: request type echoed, '0' = rejected
+    uint8_t padding[3];
+    int32_t totalAffectedOrders;
+} BinaryOrderMassCancelReport;
+
+// Session-level messages for binary sessions, so they never fall back to text.
+// A Heartbeat answering a TestRequest echoes its TestReqID (FIX 112).
+typedef struct {
+    BinaryHeader header;
+    char testReqId[20];
+    uint8_t padding[4];
+} BinaryTestRequest;
+
+typedef struct {
+    BinaryHeader header;
+    char testReqId[20];     // empty unless answering a TestRequest
+    uint8_t padding[4];
+} BinaryHeartbeat;
+
+// The layouts are part of the wire contract with client.c; catch any drift.
+_Static_assert(sizeof(BinaryHeader) == 8, "BinaryHeader layout changed");
+_Static_assert(sizeof(BinaryNewOrderSingle) == 64, "BinaryNewOrderSingle layout changed");
+_Static_assert(sizeof(BinaryOrderCancelRequest) == 32, "BinaryOrderCancelRequest layout changed");
+_Static_assert(sizeof(BinaryExecutionReport) == 64, "BinaryExecutionReport layout changed");
+_Static_assert(sizeof(BinaryMarketDataRequest) == 32, "BinaryMarketDataRequest layout changed");
+_Static_assert(sizeof(BinaryMarketData) == 40, "BinaryMarketData layout changed");
+_Static_assert(sizeof(BinaryOrderMassCancelRequest) == 32, "BinaryOrderMassCancelRequest layout changed");
+_Static_assert(sizeof(BinaryOrderMassCancelReport) == 16, "BinaryOrderMassCancelReport layout changed");
+_Static_assert(sizeof(BinaryTestRequest) == 32, "BinaryTestRequest layout changed");
+_Static_assert(sizeof(BinaryHeartbeat) == 32, "BinaryHeartbeat layout changed");
+_Static_assert(sizeof(BinaryNewOrderSingle) <= MAX_BINARY_FRAME_SIZE &&
+               sizeof(BinaryOrderCancelRequest) <= MAX_BINARY_FRAME_SIZE &&
+               sizeof(BinaryMarketDataRequest) <= MAX_BINARY_FRAME_SIZE &&
+               sizeof(BinaryOrderMassCancelRequest) <= MAX_BINARY_FRAME_SIZE &&
+               sizeof(BinaryTestRequest) <= MAX_BINARY_FRAME_SIZE &&
+               sizeof(BinaryHeartbeat) <= MAX_BINARY_FRAME_SIZE, "inbound frame exceeds MAX_BINARY_FRAME_SIZE");
+
+// An inbound order as decoded from either encoding. Only the Order record
+// below is kept once it rests on the book.
+typedef struct {
     char clOrdId[20];
-    int clientId;
     char instrument[20];
-    char side[5];
+    int sessionId;
+    int instrumentId;       // set by checkOrderRisk
     int quantity;
+    char side;              // SIDE_BUY or SIDE_SELL
     double price;
-    struct NewOrderSingle* next;
 } NewOrderSingle;
 
+// A resting order: everything the matcher reads fits in one cache line, and
+// links are pool indices rather than pointers. The ClOrdID is cold and lives
+// in orderClOrdIds[] at the same index.
 typedef struct {
-    char instrument[20];
-    double lastPx;
-} MarketData;
+    _Alignas(64) int64_t price;     // ticks
+    int32_t quantity;
+    int32_t instrumentId;
+    int32_t sessionId;
+    int32_t next;           // book neighbours, -1 = none
+    int32_t prev;
+    int32_t sessionNext;    // owning session's order list, -1 = none
+    int32_t sessionPrev;
+    int32_t sellQueueNext;  // sells only: instrument's resting sells, oldest first, -1 = none
+    int32_t sellQueuePrev;
+    char side;
+} Order;
+
+_Static_assert(sizeof(Order) == 64, "Order must stay one cache line");
+
+// A session's risk in one instrument: its filled position and what its
+// resting orders would add to it if they all filled.
+typedef struct {
+    int position;           // filled quantity, positive = long
+    int openBuyQty;
+    int openSellQty;
+} Exposure;
 
-MarketData marketDataList[MAX_ORDERS];
-int marketDataCount = 0;
+// Deployment tuning for dedicated hosts, set from the command line.
+typedef struct {
+    int sessionCore;        // core for the session (I/O + matching) thread, -1 = unpinned
+    int acceptorCore;       // core for the accept loop, -1 = unpinned
+    int busySpin;           // spin on epoll_wait instead of sleeping in it
+    int tcpNoDelay;
+    int busyPollUsec;       // SO_BUSY_POLL on client sockets, 0 = off
+    int cancelOnDisconnect; // default for sessions that don't set CancelOnDisconnect at logon
+    const char* capturePath;        // record every inbound message here
+    const char* replayPath;         // replay this capture instead of listening
+    int replayPacing;               // replay at the captured pace, not full speed
+    const char* replayOutputPath;   // where replay writes what the server sent
+    const char* goldenPath;         // replay output of a known-good run to compare against
+} ServerConfig;
+
+// One record per inbound read, followed by `length` message bytes. A record
+// with length 0 marks the session disconnecting. Replay output uses the same
+// layout for every message the server sends, stamped with the receive time
+// of the inbound message that caused it.
+typedef struct {
+    int64_t receiveTime;    // CLOCK_MONOTONIC nanoseconds
+    int32_t sessionId;      // socket fd of the session at capture time
+    uint32_t length;
+} CaptureRecord;
 
-ClientInfo clientList[MAX_PENDING_REQUESTS];
-NewOrderSingle* buyOrders = NULL;
-NewOrderSingle* sellOrders = NULL;
-int clientCount = 0;
+ServerConfig serverConfig = { -1, -1, 0, 0, 0, 0, NULL, NULL, 0, NULL, NULL };
+int epollFd;
+int captureFd = -1;
+FILE* replayOutputFile = NULL;
+int replayMode = 0;
+atomic_int shutdownRequested = 0;
+long long messageReceiveTime = 0;   // receive time of the message being handled
+
+ClientInfo sessions[MAX_SESSIONS];
+int sessionHash[SESSION_HASH_SIZE];
+int sessionCount = 0;
+ClientInfo* sessionByFd[MAX_FDS];
+int32_t buyOrders = -1;
+int32_t sellOrders = -1;
+
+Order* orderPool = NULL;
+int32_t freeOrders = -1;
+char orderClOrdIds[ORDER_POOL_SIZE][20];
 
 char sentMessages[MAX_MESSAGES][BUFFER_SIZE];
 int sentMessagesCount = 0;
 
-void handleInterrupt(int signum) {
-    for (int i = 0; i < clientCount; i++) {
-        fclose(clientList[i].logFile);
+char instrumentNames[MAX_INSTRUMENTS][20];
+int instrumentHash[INSTRUMENT_HASH_SIZE];
+int instrumentCount = 0;
+double lastTradePx[MAX_INSTRUMENTS];
+double lastSellPx[MAX_INSTRUMENTS];    // market data: first sell price posted, 0 = none
+int32_t lastSellOrder[MAX_INSTRUMENTS]; // pool index + 1 of the resting order lastSellPx came from, 0 = none
+int32_t sellQueueHead[MAX_INSTRUMENTS]; // oldest resting sell per instrument, -1 = none
+int32_t sellQueueTail[MAX_INSTRUMENTS];
+Exposure exposures[MAX_SESSIONS][MAX_INSTRUMENTS];
+
+// The reload thread parses the file into a fresh table and publishes it in
+// pendingRiskLimits; the session thread takes it from there between events,
+// so no file I/O ever runs on the session thread. The active table and the
+// per-ID instrument rows below belong to the session thread alone.
+RiskLimits* activeRiskLimits = NULL;
+_Atomic(RiskLimits*) pendingRiskLimits = NULL;
+int loadedRiskGeneration = 0;
+InstrumentLimits instrumentLimits[MAX_INSTRUMENTS];
+char instrumentTradable[MAX_INSTRUMENTS];
+
+// Runs on the main thread once the session thread has stopped, so nothing
+// else is touching the journals or the capture file.
+void shutdownServer(void) {
+    for (int i = 0; i < sessionCount; i++) {
+        if (sessions[i].logFile != NULL) {
+            fclose(sessions[i].logFile);
+        }
+    }
+    if (captureFd >= 0) {
+        close(captureFd);
     }
     close(serverSocket);
-    exit(EXIT_SUCCESS);
 }
 
 int generateCheckSum(const char* message) {
@@ -67,19 +343,213 @@ int generateCheckSum(const char* message) {
     return checksum;
 }
 
+long long monotonicNanos(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void pinCurrentThread(int core, const char* threadName) {
+    if (core < 0) {
+        return;
+    }
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(core, &cpus);
+    int error = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    if (error != 0) {
+        fprintf(stderr, "Cannot pin %s thread to core %d: %s\n", threadName, core, strerror(error));
+        return;
+    }
+    printf("Pinned %s thread to core %d.\n", threadName, core);
+}
+
+// Resting orders come from a fixed pool instead of malloc. The pool is built
+// by the thread that uses it, after pinning, so first-touch page placement
+// puts it on that core's NUMA node.
+void initOrderPool(void) {
+    orderPool = mmap(NULL, ORDER_POOL_SIZE * sizeof(Order), PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (orderPool == MAP_FAILED) {
+        perror("Cannot allocate order pool");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < ORDER_POOL_SIZE; i++) {
+        orderPool[i].next = i + 1 < ORDER_POOL_SIZE ? i + 1 : -1;
+    }
+    freeOrders = 0;
+    for (int i = 0; i < MAX_INSTRUMENTS; i++) {
+        sellQueueHead[i] = -1;
+        sellQueueTail[i] = -1;
+    }
+}
+
+int32_t allocateOrder(void) {
+    int32_t index = freeOrders;
+    if (index >= 0) {
+        freeOrders = orderPool[index].next;
+    }
+    return index;
+}
+
+void releaseOrder(int32_t index) {
+    orderPool[index].next = freeOrders;
+    freeOrders = index;
+}
+
+int32_t* bookListFor(const Order* order) {
+    return order->side == SIDE_BUY ? &buyOrders : &sellOrders;
+}
+
+// Puts a resting order at the head of its book side and of its session's list.
+void linkOrder(int32_t* bookList, int32_t index, ClientInfo* client) {
+    Order* order = &orderPool[index];
+    order->prev = -1;
+    order->next = *bookList;
+    if (*bookList >= 0) {
+        orderPool[*bookList].prev = index;
+    }
+    *bookList = index;
+
+    order->sessionPrev = -1;
+    order->sessionNext = client->orders;
+    if (client->orders >= 0) {
+        orderPool[client->orders].sessionPrev = index;
+    }
+    client->orders = index;
+
+    Exposure* exposure = &exposures[client->sessionId][order->instrumentId];
+    if (order->side == SIDE_BUY) {
+        exposure->openBuyQty += order->quantity;
+    } else {
+        exposure->openSellQty += order->quantity;
+        order->sellQueueNext = -1;
+        order->sellQueuePrev = sellQueueTail[order->instrumentId];
+        if (order->sellQueuePrev >= 0) {
+            orderPool[order->sellQueuePrev].sellQueueNext = index;
+        } else {
+            sellQueueHead[order->instrumentId] = index;
+        }
+        sellQueueTail[order->instrumentId] = index;
+    }
+}
+
+// Unlinks a resting order from the book and its session and returns it to the pool.
+void removeOrder(int32_t index) {
+    Order* order = &orderPool[index];
+    if (order->prev >= 0) {
+        orderPool[order->prev].next = order->next;
+    } else {
+        *bookListFor(order) = order->next;
+    }
+    if (order->next >= 0) {
+        orderPool[order->next].prev = order->prev;
+    }
+
+    ClientInfo* client = &sessions[order->sessionId];
+    if (order->sessionPrev >= 0) {
+        orderPool[order->sessionPrev].sessionNext = order->sessionNext;
+    } else {
+        client->orders = order->sessionNext;
+    }
+    if (order->sessionNext >= 0) {
+        orderPool[order->sessionNext].sessionPrev = order->sessionPrev;
+    }
+
+    Exposure* exposure = &exposures[order->sessionId][order->instrumentId];
+    if (order->side == SIDE_BUY) {
+        exposure->openBuyQty -= order->quantity;
+    } else {
+        exposure->openSellQty -= order->quantity;
+        if (order->sellQueuePrev >= 0) {
+            orderPool[order->sellQueuePrev].sellQueueNext = order->sellQueueNext;
+        } else {
+            sellQueueHead[order->instrumentId] = order->sellQueueNext;
+        }
+        if (order->sellQueueNext >= 0) {
+            orderPool[order->sellQueueNext].sellQueuePrev = order->sellQueuePrev;
+        } else {
+            sellQueueTail[order->instrumentId] = order->sellQueuePrev;
+        }
+    }
+    if (lastSellOrder[order->instrumentId] == index + 1) {
+        lastSellOrder[order->instrumentId] = 0;
+    }
+    releaseOrder(index);
+}
+
+// Removes an order the session cancelled. If market data was reporting its
+// price, that price is withdrawn and the oldest sell still resting in the
+// instrument, if any, is reported instead. The reported order is always the
+// head of its instrument's sell queue, so its successor is found in O(1).
+void cancelRestingOrder(int32_t index) {
+    int instrumentId = orderPool[index].instrumentId;
+    int reported = lastSellOrder[instrumentId] == index + 1;
+    removeOrder(index);
+    if (!reported) {
+        return;
+    }
+    int32_t oldest = sellQueueHead[instrumentId];
+    if (oldest >= 0) {
+        lastSellPx[instrumentId] = (double)orderPool[oldest].price / PRICE_SCALE;
+        lastSellOrder[instrumentId] = oldest + 1;
+    } else {
+        lastSellPx[instrumentId] = 0;
+    }
+}
+
+// Cancels the session's resting orders that match the filters. Walks only
+// that session's own list. instrumentId -1 and side 0 match everything.
+int massCancelOrders(ClientInfo* client, int instrumentId, char side) {
+    int cancelled = 0;
+    int32_t index = client->orders;
+    while (index >= 0) {
+        Order* order = &orderPool[index];
+        int32_t nextIndex = order->sessionNext;
+        if ((instrumentId < 0 || order->instrumentId == instrumentId) && (side == 0 || side == order->side)) {
+            cancelRestingOrder(index);
+            cancelled++;
+        }
+        index = nextIndex;
+    }
+    return cancelled;
+}
+
+int64_t priceToTicks(double price) {
+    return (int64_t)(price * PRICE_SCALE + (price < 0 ? -0.5 : 0.5));
+}
+
+const char* sideName(char side) {
+    return side == SIDE_BUY ? "BUY" : "SELL";
+}
+
 void generateSendingTime(char* timeStr) {
     time_t now = time(NULL);
     struct tm* tm_info = localtime(&now);
     strftime(timeStr, 21, "%Y%m%d-%H:%M:%S", tm_info);
 }
 
-double findLastPx(const char* instrument) {
-    for (int i = 0; i < marketDataCount; i++) {
-        if (strcmp(marketDataList[i].instrument, instrument) == 0) {
-            return marketDataList[i].lastPx;
-        }
+// Send errors only drop the one session; the peer's disconnect is picked up
+// by the next read on its socket.
+// Client sockets are non-blocking: the session thread serves every session,
+// so it must never wait on one. A client that lets its receive window fill
+// is a slow consumer and is cut off; shutdown() makes its next read return
+// EOF, so it goes through the normal disconnect path in its own event.
+void sendToClient(int clientSocket, const void* data, size_t length) {
+    if (replayMode) {
+        CaptureRecord record = { messageReceiveTime, clientSocket, (uint32_t)length };
+        fwrite(&record, sizeof(record), 1, replayOutputFile);
+        fwrite(data, 1, length, replayOutputFile);
+        return;
+    }
+    ssize_t bytesSent = send(clientSocket, data, length, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if ((bytesSent >= 0 && (size_t)bytesSent < length) ||
+        (bytesSent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))) {
+        printf("Slow consumer on socket %d, disconnecting\n", clientSocket);
+        shutdown(clientSocket, SHUT_RDWR);
+    } else if (bytesSent < 0) {
+        perror("Error in sending data");
     }
-    return -1.0;  // Special value to indicate that the instrument was not found
 }
 
 void writeLog(FILE* logFile, const char* message) {
@@ -89,30 +559,346 @@ void writeLog(FILE* logFile, const char* message) {
     fflush(logFile);
 }
 
+#define FNV_OFFSET_BASIS 2166136261u
+
+unsigned int hashString(const char* text, unsigned int hash) {
+    for (const char* p = text; *p; p++) {
+        hash = (hash ^ (unsigned char)*p) * 16777619u;
+    }
+    return hash;
+}
+
+// Returns the hash slot holding the instrument, or the empty slot it would take.
+unsigned int findInstrumentSlot(const char* instrument) {
+    unsigned int slot = hashString(instrument, FNV_OFFSET_BASIS) & (INSTRUMENT_HASH_SIZE - 1);
+    while (instrumentHash[slot] != 0 && strcmp(instrumentNames[instrumentHash[slot] - 1], instrument) != 0) {
+        slot = (slot + 1) & (INSTRUMENT_HASH_SIZE - 1);
+    }
+    return slot;
+}
+
+// Returns the instrument's ID, or -1 if it has never been seen.
+int findInstrumentId(const char* instrument) {
+    return instrumentHash[findInstrumentSlot(instrument)] - 1;
+}
+
+// Returns the dense ID for an instrument, assigning one on first sight.
+// Returns -1 once MAX_INSTRUMENTS distinct instruments have been seen.
+int lookupInstrumentId(const char* instrument) {
+    unsigned int slot = findInstrumentSlot(instrument);
+    if (instrumentHash[slot] != 0) {
+        return instrumentHash[slot] - 1;
+    }
+    if (instrumentCount >= MAX_INSTRUMENTS) {
+        return -1;
+    }
+    int id = instrumentCount++;
+    strncpy(instrumentNames[id], instrument, sizeof(instrumentNames[id]) - 1);
+    instrumentHash[slot] = id + 1;
+    return id;
+}
+
+double findLastPx(const char* instrument) {
+    int instrumentId = findInstrumentId(instrument);
+    if (instrumentId < 0 || lastSellPx[instrumentId] <= 0) {
+        return -1.0;  // Special value to indicate that the instrument was not found
+    }
+    return lastSellPx[instrumentId];
+}
+
+// Finds the session for a SenderCompID/TargetCompID pair, creating it on
+// first Logon. Returns NULL once MAX_SESSIONS sessions exist.
+ClientInfo* lookupSession(const char* compId, const char* targetCompId) {
+    unsigned int slot = hashString(targetCompId, hashString(compId, FNV_OFFSET_BASIS)) & (SESSION_HASH_SIZE - 1);
+    while (sessionHash[slot] != 0) {
+        ClientInfo* client = &sessions[sessionHash[slot] - 1];
+        if (strcmp(client->compId, compId) == 0 && strcmp(client->targetCompId, targetCompId) == 0) {
+            return client;
+        }
+        slot = (slot + 1) & (SESSION_HASH_SIZE - 1);
+    }
+    if (sessionCount >= MAX_SESSIONS) {
+        return NULL;
+    }
+
+    ClientInfo* client = &sessions[sessionCount];
+    memset(client, 0, sizeof(*client));
+    client->sessionId = sessionCount++;
+    client->clientId = -1;
+    client->orders = -1;
+    client->nextOutSeqNum = 1;
+    strcpy(client->compId, compId);
+    strcpy(client->targetCompId, targetCompId);
+    sessionHash[slot] = client->sessionId + 1;
+    return client;
+}
+
+// Copies a "Name=value|" field of the message into value. Returns 0 if the
+// field is missing, empty or does not fit.
+int findField(const char* message, const char* name, char* value, size_t size) {
+    const char* field = strstr(message, name);
+    if (field == NULL) {
+        return 0;
+    }
+    field += strlen(name);
+    size_t length = strcspn(field, "|");
+    if (length == 0 || length >= size) {
+        return 0;
+    }
+    memcpy(value, field, length);
+    value[length] = '\0';
+    return 1;
+}
+
+void parseSessionLimits(char* fields, SessionLimits* limits) {
+    for (char* field = strtok(fields, " \t\n"); field != NULL; field = strtok(NULL, " \t\n")) {
+        sscanf(field, "maxOrderQty=%d", &limits->maxOrderQty);
+        sscanf(field, "maxNotional=%lf", &limits->maxNotional);
+        sscanf(field, "maxOrdersPerSec=%d", &limits->maxOrdersPerSec);
+        sscanf(field, "maxPosition=%d", &limits->maxPosition);
+    }
+}
+
+void parseInstrumentLimits(char* fields, InstrumentLimits* limits) {
+    for (char* field = strtok(fields, " \t\n"); field != NULL; field = strtok(NULL, " \t\n")) {
+        sscanf(field, "maxOrderQty=%d", &limits->maxOrderQty);
+        sscanf(field, "priceBandPct=%lf", &limits->priceBandPct);
+        sscanf(field, "referencePx=%lf", &limits->referencePx);
+    }
+}
+
+_Static_assert(COMP_ID_SIZE == 32, "risk config reads a CompID with %31s");
+
+// Config lines:
+//   default maxOrderQty=1000 maxNotional=100000 maxOrdersPerSec=50 maxPosition=5000
+//   session CLIENT1 maxOrderQty=500
+//   instrument AAPL priceBandPct=5 referencePx=190.00 maxOrderQty=200
+//   instrument MSFT
+RiskLimits* loadRiskLimits(const char* path) {
+    RiskLimits* limits = calloc(1, sizeof(*limits));
+    if (limits == NULL) {
+        perror("Cannot allocate risk limits");
+        return NULL;
+    }
+    limits->generation = ++loadedRiskGeneration;
+
+    FILE* fp = fopen(path, "r");
+    if (fp == NULL) {
+        printf("No risk limits loaded from %s, no instrument is tradable.\n", path);
+    } else {
+        char line[BUFFER_SIZE];
+        while (fgets(line, sizeof(line), fp) != NULL) {
+            char kind[20], name[COMP_ID_SIZE];
+            int offset = 0, nameOffset = 0;
+            if (line[0] == '#' || sscanf(line, "%19s %n", kind, &offset) != 1) {
+                continue;
+            }
+            if (strcmp(kind, "default") == 0) {
+                parseSessionLimits(line + offset, &limits->defaultSession);
+            } else if (strcmp(kind, "session") == 0 && limits->profileCount < MAX_RISK_PROFILES &&
+                       sscanf(line + offset, "%31s %n", name, &nameOffset) == 1) {
+                int profile = limits->profileCount++;
+                strcpy(limits->profileCompIds[profile], name);
+                parseSessionLimits(line + offset + nameOffset, &limits->profiles[profile]);
+            } else if (strcmp(kind, "instrument") == 0 && sscanf(line + offset, "%19s %n", name, &nameOffset) == 1) {
+                if (limits->instrumentCount >= MAX_INSTRUMENTS) {
+                    printf("Too many instruments in %s, %s ignored.\n", path, name);
+                    continue;
+                }
+                int instrument = limits->instrumentCount++;
+                strcpy(limits->instrumentNames[instrument], name);
+                parseInstrumentLimits(line + offset + nameOffset, &limits->instruments[instrument]);
+            }
+        }
+        fclose(fp);
+        printf("Loaded risk limits and %d instruments from %s (generation %d).\n",
+               limits->instrumentCount, path, limits->generation);
+    }
+    return limits;
+}
+
+// Called from the reload thread. A table the session thread has not picked
+// up yet is simply replaced.
+void publishRiskLimits(RiskLimits* limits) {
+    if (limits == NULL) {
+        return;
+    }
+    free(atomic_exchange(&pendingRiskLimits, limits));
+}
+
+// Session thread only: makes a newly loaded table the active one. Instrument
+// IDs are never reused, so an instrument dropped from the file keeps its ID
+// (and any resting orders) but stops accepting new orders.
+void adoptRiskLimits(RiskLimits* limits) {
+    memset(instrumentLimits, 0, sizeof(instrumentLimits));
+    memset(instrumentTradable, 0, sizeof(instrumentTradable));
+    for (int i = 0; i < limits->instrumentCount; i++) {
+        int instrumentId = lookupInstrumentId(limits->instrumentNames[i]);
+        if (instrumentId >= 0) {
+            instrumentLimits[instrumentId] = limits->instruments[i];
+            instrumentTradable[instrumentId] = 1;
+        }
+    }
+    free(activeRiskLimits);
+    activeRiskLimits = limits;
+}
+
+// Parses the file on every SIGHUP. SIGHUP is blocked in every other thread,
+// so it is always delivered here.
+void* runRiskReloadThread(void* arg) {
+    sigset_t reloadSignals;
+    sigemptyset(&reloadSignals);
+    sigaddset(&reloadSignals, SIGHUP);
+    while (1) {
+        int signum;
+        if (sigwait(&reloadSignals, &signum) == 0) {
+            publishRiskLimits(loadRiskLimits(RISK_CONFIG_FILE));
+        }
+    }
+    return NULL;
+}
+
+void resolveRiskProfile(ClientInfo* client, const RiskLimits* limits) {
+    client->riskProfile = -1;
+    for (int i = 0; i < limits->profileCount; i++) {
+        if (strcmp(limits->profileCompIds[i], client->compId) == 0) {
+            client->riskProfile = i;
+            break;
+        }
+    }
+    client->riskGeneration = limits->generation;
+}
+
+// Runs before the matcher sees an order. Every check is a handful of loads
+// and compares against the session's and instrument's row in the limit
+// tables; the profile lookup only happens once per session per reload.
+// Returns NULL if the order passes, or the reject reason.
+const char* checkOrderRisk(ClientInfo* client, NewOrderSingle* order) {
+    const RiskLimits* limits = activeRiskLimits;
+    if (client->riskGeneration != limits->generation) {
+        resolveRiskProfile(client, limits);
+    }
+    const SessionLimits* session = client->riskProfile >= 0 ? &limits->profiles[client->riskProfile] : &limits->defaultSession;
+
+    if (order->instrument[0] == '\0' || order->quantity <= 0 || order->price <= 0) {
+        return "Invalid instrument, quantity or price";
+    }
+    order->instrumentId = findInstrumentId(order->instrument);
+    if (order->instrumentId < 0 || !instrumentTradable[order->instrumentId]) {
+        return "Unknown instrument";
+    }
+    const InstrumentLimits* instrument = &instrumentLimits[order->instrumentId];
+    if ((session->maxOrderQty > 0 && order->quantity > session->maxOrderQty) ||
+        (instrument->maxOrderQty > 0 && order->quantity > instrument->maxOrderQty)) {
+        return "Order quantity exceeds limit";
+    }
+    if (session->maxNotional > 0 && order->quantity * order->price > session->maxNotional) {
+        return "Order notional exceeds limit";
+    }
+
+    double referencePx = instrument->referencePx > 0 ? instrument->referencePx : lastTradePx[order->instrumentId];
+    if (instrument->priceBandPct > 0 && referencePx > 0) {
+        double band = referencePx * instrument->priceBandPct / 100.0;
+        if (order->price < referencePx - band || order->price > referencePx + band) {
+            return "Price outside band";
+        }
+    }
+
+    // Worst case: this order and every resting order on its side fill
+    if (session->maxPosition > 0) {
+        const Exposure* exposure = &exposures[client->sessionId][order->instrumentId];
+        if ((order->side == SIDE_BUY &&
+             exposure->position + exposure->openBuyQty + order->quantity > session->maxPosition) ||
+            (order->side == SIDE_SELL &&
+             exposure->position - exposure->openSellQty - order->quantity < -session->maxPosition)) {
+            return "Position limit exceeded";
+        }
+    }
+
+    if (session->maxOrdersPerSec > 0) {
+        long long now = messageReceiveTime;
+        if (now - client->rateWindowStart >= 1000000000LL) {
+            client->rateWindowStart = now;
+            client->rateWindowOrders = 0;
+        }
+        if (client->rateWindowOrders >= session->maxOrdersPerSec) {
+            return "Order rate limit exceeded";
+        }
+        client->rateWindowOrders++;
+    }
+
+    return NULL;
+}
+
 void parseNewOrderSingle(const char* message, NewOrderSingle* order) {
-    sscanf(message, "CompID=%*[^|]|ServerSeqNum=%*d|ClientSeqNum=%*d|MsgType=%*[^|]|ClOrdID=%[^|]|Instrument=%[^|]|Side=%[^|]|Quantity=%d|Price=%lf",
-           order->clOrdId, order->instrument, order->side, &order->quantity, &order->price);
+    char side[5] = "";
+    sscanf(message, "CompID=%*[^|]|ServerSeqNum=%*d|ClientSeqNum=%*d|MsgType=%*[^|]|ClOrdID=%19[^|]|Instrument=%19[^|]|Side=%4[^|]|Quantity=%d|Price=%lf",
+           order->clOrdId, order->instrument, side, &order->quantity, &order->price);
+    order->side = strcmp(side, "BUY") == 0 ? SIDE_BUY : strcmp(side, "SELL") == 0 ? SIDE_SELL : 0;
 }
 
 void formatNewOrderSingle(const NewOrderSingle* order, char* message) {
     sprintf(message, "CompID=SERVER|ServerSeqNum=0|ClientSeqNum=0|MsgType=NewOrderSingle|ClOrdID=%s|Instrument=%s|Side=%s|Quantity=%d|Price=%.2f|",
-            order->clOrdId, order->instrument, order->side, order->quantity, order->price);
+            order->clOrdId, order->instrument, sideName(order->side), order->quantity, order->price);
     int checksum = generateCheckSum(message);
     sprintf(message + strlen(message), "SendingTime=YYYYMMDD-HH:MM:SS|CheckSum=%d|", checksum);
 }
 
-void handleNewOrderSingle(ClientInfo* client, NewOrderSingle* order, FILE* logFile, NewOrderSingle** buyOrders, NewOrderSingle** sellOrders, int* serverSeqNum) {
+void sendBinaryMessage(ClientInfo* client, BinaryHeader* header, size_t size, uint16_t templateId) {
+    header->blockLength = (uint16_t)(size - sizeof(BinaryHeader));
+    header->templateId = templateId;
+    header->seqNum = (uint32_t)client->nextOutSeqNum++;
+    sendToClient(client->clientId, header, size);
+}
+
+void sendBinaryExecutionReport(ClientInfo* client, const char* clOrdId, const char* instrument, char side,
+                               int quantity, double price, char ordStatus) {
+    BinaryExecutionReport report;
+    memset(&report, 0, sizeof(report));
+    strncpy(report.clOrdId, clOrdId, sizeof(report.clOrdId) - 1);
+    strncpy(report.instrument, instrument, sizeof(report.instrument) - 1);
+    report.side = (uint8_t)side;
+    report.ordStatus = (uint8_t)ordStatus;
+    report.quantity = quantity;
+    report.price = priceToTicks(price);
+    sendBinaryMessage(client, &report.header, sizeof(report), BINARY_TEMPLATE_EXECUTION_REPORT);
+}
+
+// Tells a resting order's session that it was filled, in the session's own
+// encoding. Nothing is sent while the session is disconnected.
+void sendFillReport(int32_t index) {
+    Order* order = &orderPool[index];
+    ClientInfo* owner = &sessions[order->sessionId];
+    if (owner->clientId < 0) {
+        return;
+    }
+    double price = (double)order->price / PRICE_SCALE;
+    if (owner->encoding == ENCODING_BINARY) {
+        sendBinaryExecutionReport(owner, orderClOrdIds[index], instrumentNames[order->instrumentId],
+                                  order->side, order->quantity, price, '2');
+        return;
+    }
+    char buffer[BUFFER_SIZE];
+    sprintf(buffer, "CompID=SERVER|ServerSeqNum=%d|ClientSeqNum=%d|MsgType=8|ClOrdID=%s|OrdStatus=2|Instrument=%s|Side=%s|Quantity=%d|Price=%.2f|",
+            owner->nextOutSeqNum++, owner->lastSeqNum, orderClOrdIds[index], instrumentNames[order->instrumentId],
+            sideName(order->side), order->quantity, price);
+    sendToClient(owner->clientId, buffer, strlen(buffer));
+}
+
+// Matches the order or books it. Returns its FIX OrdStatus: '2' if it filled
+// against a resting order, '0' if it now rests, '8' if it could not be booked.
+char handleNewOrderSingle(ClientInfo* client, NewOrderSingle* order, FILE* logFile, int32_t* buyOrders, int32_t* sellOrders) {
     char orderDetails[BUFFER_SIZE];
     sprintf(orderDetails, "ClientID: %d, ClOrdID: %s, Instrument: %s, Side: %s, Quantity: %d, Price: %.2f",
-            client->clientId, order->clOrdId, order->instrument, order->side, order->quantity, order->price);
+            client->clientId, order->clOrdId, order->instrument, sideName(order->side), order->quantity, order->price);
     writeLog(logFile, orderDetails);
     fflush(logFile);
 
     printf("%s\n", orderDetails);
 
-    NewOrderSingle** ownOrderList;
-    NewOrderSingle** oppositeOrderList;
-    int isBuyOrder = strcmp(order->side, "BUY") == 0;
+    int32_t* ownOrderList;
+    int32_t* oppositeOrderList;
+    int isBuyOrder = order->side == SIDE_BUY;
     if (isBuyOrder) {
         ownOrderList = buyOrders;
         oppositeOrderList = sellOrders;
@@ -121,61 +907,62 @@ void handleNewOrderSingle(ClientInfo* client, NewOrderSingle* order, FILE* logFi
         oppositeOrderList = buyOrders;
     }
 
-    NewOrderSingle* prevOrder = NULL;
-    NewOrderSingle* currentOrder = *oppositeOrderList;
-    while (currentOrder != NULL) {
-        if (strcmp(currentOrder->instrument, order->instrument) == 0 && currentOrder->quantity == order->quantity) {
-            if ((isBuyOrder && currentOrder->price <= order->price) ||
-                (!isBuyOrder && currentOrder->price >= order->price)) {
-                printf("%d%d", (int)order->price, (int)currentOrder->price);
+    // Only integer fields of the resting Order are compared, one cache line per order
+    int64_t price = priceToTicks(order->price);
+    int32_t index = *oppositeOrderList;
+    while (index >= 0) {
+        Order* currentOrder = &orderPool[index];
+        if (currentOrder->instrumentId == order->instrumentId && currentOrder->quantity == order->quantity) {
+            if ((isBuyOrder && currentOrder->price <= price) ||
+                (!isBuyOrder && currentOrder->price >= price)) {
                 printf("Match found: %s\n", orderDetails);
 
                 client->lastSeqNum++;
-                (*serverSeqNum)++;
 
-                if (prevOrder == NULL) {
-                    *oppositeOrderList = currentOrder->next;
-                } else {
-                    prevOrder->next = currentOrder->next;
-                }
-                free(currentOrder);
+                // Track filled positions for both sides and the band reference price
+                int filledQuantity = isBuyOrder ? order->quantity : -order->quantity;
+                exposures[client->sessionId][order->instrumentId].position += filledQuantity;
+                exposures[currentOrder->sessionId][currentOrder->instrumentId].position -= filledQuantity;
+                lastTradePx[order->instrumentId] = (double)currentOrder->price / PRICE_SCALE;
 
-                // Send message to client about completed order
-                printf("Match found: %s\n", orderDetails);
+                sendFillReport(index);
+                removeOrder(index);
 
-                return;
+                return '2';
             }
         }
-        prevOrder = currentOrder;
-        currentOrder = currentOrder->next;
+        index = currentOrder->next;
     }
 
-    NewOrderSingle* newOrder = (NewOrderSingle*) malloc(sizeof(NewOrderSingle));
-    if (newOrder == NULL) {
+    int32_t newIndex = allocateOrder();
+    if (newIndex < 0) {
         // Handle error, e.g., by logging and returning
-        fprintf(logFile, "Failed to allocate memory for new order.\n");
+        fprintf(logFile, "Order pool exhausted, order not booked.\n");
         fflush(logFile);
-        return;
+        return '8';
     }
-    *newOrder = *order;
-    newOrder->clientId = client->clientId;  // Remember to set the client ID in the new order
-    newOrder->next = *ownOrderList;
-    *ownOrderList = newOrder;
+    Order* newOrder = &orderPool[newIndex];
+    newOrder->price = price;
+    newOrder->quantity = order->quantity;
+    newOrder->instrumentId = order->instrumentId;
+    newOrder->sessionId = client->sessionId;  // Remember to set the owning session in the new order
+    newOrder->side = order->side;
+    strcpy(orderClOrdIds[newIndex], order->clOrdId);
+    linkOrder(ownOrderList, newIndex, client);
 
     client->lastSeqNum++;
-    (*serverSeqNum)++;
 
-    // Only add sell orders to market data list
-    if (!isBuyOrder) {
-        strcpy(marketDataList[marketDataCount].instrument, order->instrument);
-        marketDataList[marketDataCount].lastPx = order->price;
-        (marketDataCount)++;
+    // Only sell orders update market data; the first sell posted is the one reported
+    if (!isBuyOrder && lastSellPx[order->instrumentId] <= 0) {
+        lastSellPx[order->instrumentId] = order->price;
+        lastSellOrder[order->instrumentId] = newIndex + 1;
     }
+    return '0';
 }
 
 void handleMarketDataRequest(ClientInfo* client, const char* message, int clientSocket, char* buffer) {
-    char instrument[20];
-    sscanf(message, "CompID=%*[^|]|ServerSeqNum=%*d|ClientSeqNum=%*d|MsgType=%*[^|]|Instrument=%[^|]|",
+    char instrument[20] = "";
+    sscanf(message, "CompID=%*[^|]|ServerSeqNum=%*d|ClientSeqNum=%*d|MsgType=%*[^|]|Instrument=%19[^|]|",
            instrument);
 
     writeLog(client->logFile, "Market data request received.");
@@ -184,44 +971,81 @@ void handleMarketDataRequest(ClientInfo* client, const char* message, int client
     double lastPx = findLastPx(instrument);
     if (lastPx >= 0) {
         sprintf(buffer, "CompID=SERVER|ServerSeqNum=%d|ClientSeqNum=%d|MsgType=W|Instrument=%s|LastPx=%.2f|",
-                serverSeqNum++, client->lastSeqNum++, instrument, lastPx);
+                client->nextOutSeqNum++, client->lastSeqNum++, instrument, lastPx);
     } else {
         sprintf(buffer, "CompID=SERVER|ServerSeqNum=%d|ClientSeqNum=%d|MsgType=3|Text=Instrument not found|",
-                serverSeqNum++, client->lastSeqNum++);
+                client->nextOutSeqNum++, client->lastSeqNum++);
     }
-    send(clientSocket, buffer, strlen(buffer), 0);
+    sendToClient(clientSocket, buffer, strlen(buffer));
 }
 
 
-void handleLogon(ClientInfo* client, int clientSocket, char* buffer) {
-    char compId[10];
-    sscanf(buffer, "CompID=%[^|]|", compId);
-
-    client->clientId = clientSocket;
-    client->lastSeqNum = 0;
-    strncpy(client->compId, compId, sizeof(client->compId));
+FILE* openSessionLog(const ClientInfo* client) {
+    // A replay must not append replayed traffic to the live journals
+    if (replayMode) {
+        return fopen("/dev/null", "a");
+    }
 
-    char logFileName[20];
-    sprintf(logFileName, "%s.log", client->compId);
+    char logFileName[2 * COMP_ID_SIZE + 8];
+    sprintf(logFileName, "%s-%s.log", client->compId, client->targetCompId);
 
     char fullPath[1024]; 
     const char *directoryPath = "/Users/alpaltug/Desktop/code/staj'23/cboe/";
     sprintf(fullPath, "%s/%s", directoryPath, logFileName);
 
-    client->logFile = fopen(fullPath, "w");
-    if (clientList[clientCount].logFile == NULL) {
+    // Append, so a reconnecting session continues its journal
+    FILE* logFile = fopen(fullPath, "a");
+    if (logFile == NULL) {
         perror("Error in opening log file");
-        exit(EXIT_FAILURE);
+        logFile = fopen(logFileName, "a");
     }
+    return logFile;
+}
 
-    writeLog(client->logFile, "Client successfully logged on.");
+void handleLogon(const char* message, int clientSocket, char* buffer) {
+    char compId[COMP_ID_SIZE];
+    char targetCompId[COMP_ID_SIZE] = "SERVER";
+    if (strncmp(message, "CompID=", 7) != 0 || !findField(message, "CompID=", compId, sizeof(compId))) {
+        strcpy(buffer, "Logon rejected: missing or invalid CompID.");
+        sendToClient(clientSocket, buffer, strlen(buffer));
+        return;
+    }
+    findField(message, "|TargetCompID=", targetCompId, sizeof(targetCompId));
 
-    strcpy(buffer, "Logon successful.");
-    ssize_t bytesSent = send(clientSocket, buffer, strlen(buffer), 0);
-    if (bytesSent < 0) {
-        perror("Error in sending data");
-        exit(EXIT_FAILURE);
+    ClientInfo* client = lookupSession(compId, targetCompId);
+    if (client == NULL) {
+        strcpy(buffer, "Logon rejected: too many sessions.");
+        sendToClient(clientSocket, buffer, strlen(buffer));
+        return;
     }
+    if ((client->clientId >= 0 && client->clientId != clientSocket) ||
+        (sessionByFd[clientSocket] != NULL && sessionByFd[clientSocket] != client)) {
+        strcpy(buffer, "Logon rejected: session already connected.");
+        sendToClient(clientSocket, buffer, strlen(buffer));
+        return;
+    }
+
+    if (client->logFile == NULL) {
+        client->logFile = openSessionLog(client);
+        if (client->logFile == NULL) {
+            strcpy(buffer, "Logon rejected: cannot open session log.");
+            sendToClient(clientSocket, buffer, strlen(buffer));
+            return;
+        }
+    }
+    client->clientId = clientSocket;
+    client->pendingLength = 0;
+    sessionByFd[clientSocket] = client;
+    client->encoding = strstr(message, "Encoding=BINARY|") != NULL ? ENCODING_BINARY : ENCODING_TEXT;
+    char cancelOnDisconnect[2];
+    client->cancelOnDisconnect = findField(message, "|CancelOnDisconnect=", cancelOnDisconnect, sizeof(cancelOnDisconnect)) ?
+                                 cancelOnDisconnect[0] == 'Y' : serverConfig.cancelOnDisconnect;
+
+    writeLog(client->logFile, client->encoding == ENCODING_BINARY ?
+             "Client successfully logged on (binary encoding)." : "Client successfully logged on.");
+
+    strcpy(buffer, "Logon successful.");
+    sendToClient(clientSocket, buffer, strlen(buffer));
 }
 
 void handleTestRequest(ClientInfo* client, int clientSocket, char* buffer) {
@@ -229,11 +1053,7 @@ void handleTestRequest(ClientInfo* client, int clientSocket, char* buffer) {
     fflush(client->logFile);
 
     strcpy(buffer, "TestResponse");
-    ssize_t bytesSent = send(clientSocket, buffer, strlen(buffer), 0);
-    if (bytesSent < 0) {
-        perror("Error in sending data");
-        exit(EXIT_FAILURE);
-    }
+    sendToClient(clientSocket, buffer, strlen(buffer));
 }
 
 void handleResendRequest(ClientInfo* client, const char* message, int clientSocket) {
@@ -246,12 +1066,19 @@ void handleResendRequest(ClientInfo* client, const char* message, int clientSock
 
     // Resend requested messages
     for (int i = beginSeqNo - 1; i < endSeqNo && i < sentMessagesCount; i++) {
-        ssize_t bytesSent = send(clientSocket, sentMessages[i], strlen(sentMessages[i]), 0);
-        if (bytesSent < 0) {
-            perror("Error in sending data");
-            exit(EXIT_FAILURE);
+        sendToClient(clientSocket, sentMessages[i], strlen(sentMessages[i]));
+    }
+}
+
+// Only the requesting session's own orders are searched.
+int cancelOrder(ClientInfo* client, const char* clOrdId) {
+    for (int32_t index = client->orders; index >= 0; index = orderPool[index].sessionNext) {
+        if (strcmp(orderClOrdIds[index], clOrdId) == 0) {
+            cancelRestingOrder(index);
+            return 1;
         }
     }
+    return 0;
 }
 
 void handleOrderCancelRequest(ClientInfo* client, const char* message, int clientSocket, char* buffer) {
@@ -262,139 +1089,542 @@ void handleOrderCancelRequest(ClientInfo* client, const char* message, int clien
     writeLog(client->logFile, "Order cancel request received.");
     fflush(client->logFile);
 
-    // Cancel order
-    NewOrderSingle* prevOrder = NULL;
-    NewOrderSingle* currentOrder = buyOrders;
-    while (currentOrder != NULL) {
-        if (strcmp(currentOrder->clOrdId, clOrdId) == 0) {
-            if (prevOrder == NULL) {
-                buyOrders = currentOrder->next;
-            } else {
-                prevOrder->next = currentOrder->next;
-            }
-            free(currentOrder);
-            break;
-        }
-        prevOrder = currentOrder;
-        currentOrder = currentOrder->next;
+    cancelOrder(client, clOrdId);
+
+    // Send response to client
+    sprintf(buffer, "Order with ClOrdID=%s has been cancelled.", clOrdId);
+    sendToClient(clientSocket, buffer, strlen(buffer));
+}
+
+// Returns the number of orders cancelled, or -1 if the request is invalid.
+int applyMassCancel(ClientInfo* client, char requestType, const char* instrument, char side) {
+    if (requestType == MASS_CANCEL_ALL) {
+        return massCancelOrders(client, -1, side);
+    }
+    if (requestType != MASS_CANCEL_BY_INSTRUMENT || instrument[0] == '\0') {
+        return -1;
     }
+    int instrumentId = findInstrumentId(instrument);
+    return instrumentId < 0 ? 0 : massCancelOrders(client, instrumentId, side);
+}
 
-    prevOrder = NULL;
-    currentOrder = sellOrders;
-    while (currentOrder != NULL) {
-        if (strcmp(currentOrder->clOrdId, clOrdId) == 0) {
-            if (prevOrder == NULL) {
-                sellOrders = currentOrder->next;
-            } else {
-                prevOrder->next = currentOrder->next;
-            }
-            free(currentOrder);
-            break;
+void handleOrderMassCancelRequest(ClientInfo* client, const char* message, int clientSocket, char* buffer) {
+    char requestType[2] = "", instrument[20] = "", side[5] = "";
+    findField(message, "|MassCancelRequestType=", requestType, sizeof(requestType));
+    findField(message, "|Instrument=", instrument, sizeof(instrument));
+    findField(message, "|Side=", side, sizeof(side));
+
+    writeLog(client->logFile, "Order mass cancel request received.");
+
+    char sideCode = strcmp(side, "BUY") == 0 ? SIDE_BUY : strcmp(side, "SELL") == 0 ? SIDE_SELL : 0;
+    int cancelled = applyMassCancel(client, requestType[0], instrument, sideCode);
+
+    sprintf(buffer, "CompID=SERVER|ServerSeqNum=%d|ClientSeqNum=%d|MsgType=r|MassCancelRequestType=%s|MassCancelResponse=%c|TotalAffectedOrders=%d|",
+            client->nextOutSeqNum++, client->lastSeqNum, requestType, cancelled < 0 ? '0' : requestType[0], cancelled < 0 ? 0 : cancelled);
+    sendToClient(clientSocket, buffer, strlen(buffer));
+}
+
+// Replayed sessions have no socket behind their ID, so leave the fd alone.
+void releaseSocket(int clientSocket) {
+    if (replayMode) {
+        return;
+    }
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, clientSocket, NULL);
+    close(clientSocket);
+}
+
+// Only the connection and the journal handle go away; the session keeps its
+// state for the next Logon.
+void closeClient(ClientInfo* client) {
+    printf("Client disconnected\n");
+    writeLog(client->logFile, "Client disconnected.");
+    if (client->cancelOnDisconnect) {
+        char logMessage[64];
+        sprintf(logMessage, "Cancel on disconnect: %d orders cancelled.", massCancelOrders(client, -1, 0));
+        writeLog(client->logFile, logMessage);
+    }
+    sessionByFd[client->clientId] = NULL;
+    releaseSocket(client->clientId);
+    client->clientId = -1;
+    client->pendingLength = 0;
+
+    // Reopened in append mode by the next Logon
+    fclose(client->logFile);
+    client->logFile = NULL;
+}
+
+void handleBinaryNewOrderSingle(ClientInfo* client, const BinaryNewOrderSingle* request) {
+    NewOrderSingle order;
+    memcpy(order.clOrdId, request->clOrdId, sizeof(order.clOrdId));
+    order.clOrdId[sizeof(order.clOrdId) - 1] = '\0';
+    memcpy(order.instrument, request->instrument, sizeof(order.instrument));
+    order.instrument[sizeof(order.instrument) - 1] = '\0';
+    order.side = (char)request->side;
+    order.quantity = request->quantity;
+    order.price = (double)request->price / PRICE_SCALE;
+    order.sessionId = client->sessionId;
+
+    const char* rejectReason = order.side != SIDE_BUY && order.side != SIDE_SELL ?
+                               "Invalid side" : checkOrderRisk(client, &order);
+    if (rejectReason != NULL) {
+        writeLog(client->logFile, rejectReason);
+        sendBinaryExecutionReport(client, order.clOrdId, order.instrument, order.side,
+                                  order.quantity, order.price, '8');
+        return;
+    }
+
+    char ordStatus = handleNewOrderSingle(client, &order, client->logFile, &buyOrders, &sellOrders);
+
+    sendBinaryExecutionReport(client, order.clOrdId, order.instrument, order.side,
+                              order.quantity, order.price, ordStatus);
+}
+
+void handleBinaryOrderCancelRequest(ClientInfo* client, const BinaryOrderCancelRequest* request) {
+    char clOrdId[20];
+    memcpy(clOrdId, request->clOrdId, sizeof(clOrdId));
+    clOrdId[sizeof(clOrdId) - 1] = '\0';
+
+    writeLog(client->logFile, "Order cancel request received.");
+
+    char ordStatus = cancelOrder(client, clOrdId) ? '4' : '8';
+    sendBinaryExecutionReport(client, clOrdId, "", 0, 0, 0.0, ordStatus);
+}
+
+void handleBinaryMarketDataRequest(ClientInfo* client, const BinaryMarketDataRequest* request) {
+    BinaryMarketData marketData;
+    memset(&marketData, 0, sizeof(marketData));
+    memcpy(marketData.instrument, request->instrument, sizeof(marketData.instrument));
+    marketData.instrument[sizeof(marketData.instrument) - 1] = '\0';
+
+    writeLog(client->logFile, "Market data request received.");
+
+    double lastPx = findLastPx(marketData.instrument);
+    marketData.lastPx = lastPx >= 0 ? priceToTicks(lastPx) : -1;
+    sendBinaryMessage(client, &marketData.header, sizeof(marketData), BINARY_TEMPLATE_MARKET_DATA);
+}
+
+void handleBinaryOrderMassCancelRequest(ClientInfo* client, const BinaryOrderMassCancelRequest* request) {
+    char instrument[20];
+    memcpy(instrument, request->instrument, sizeof(instrument));
+    instrument[sizeof(instrument) - 1] = '\0';
+
+    writeLog(client->logFile, "Order mass cancel request received.");
+
+    int cancelled = applyMassCancel(client, (char)request->massCancelRequestType, instrument, (char)request->side);
+
+    BinaryOrderMassCancelReport report;
+    memset(&report, 0, sizeof(report));
+    report.massCancelResponse = cancelled < 0 ? '0' : request->massCancelRequestType;
+    report.totalAffectedOrders = cancelled < 0 ? 0 : cancelled;
+    sendBinaryMessage(client, &report.header, sizeof(report), BINARY_TEMPLATE_ORDER_MASS_CANCEL_REPORT);
+}
+
+void handleBinaryTestRequest(ClientInfo* client, const BinaryTestRequest* request) {
+    writeLog(client->logFile, "Client test request received.");
+
+    BinaryHeartbeat heartbeat;
+    memset(&heartbeat, 0, sizeof(heartbeat));
+    memcpy(heartbeat.testReqId, request->testReqId, sizeof(heartbeat.testReqId));
+    heartbeat.testReqId[sizeof(heartbeat.testReqId) - 1] = '\0';
+    sendBinaryMessage(client, &heartbeat.header, sizeof(heartbeat), BINARY_TEMPLATE_HEARTBEAT);
+}
+
+void dispatchBinaryFrame(ClientInfo* client, const char* frame, ssize_t frameSize) {
+    BinaryHeader header;
+    memcpy(&header, frame, sizeof(header));
+    client->lastSeqNum = (int)header.seqNum;
+    if (header.templateId == BINARY_TEMPLATE_NEW_ORDER_SINGLE && frameSize == sizeof(BinaryNewOrderSingle)) {
+        BinaryNewOrderSingle request;
+        memcpy(&request, frame, sizeof(request));
+        handleBinaryNewOrderSingle(client, &request);
+    } else if (header.templateId == BINARY_TEMPLATE_ORDER_CANCEL_REQUEST && frameSize == sizeof(BinaryOrderCancelRequest)) {
+        BinaryOrderCancelRequest request;
+        memcpy(&request, frame, sizeof(request));
+        handleBinaryOrderCancelRequest(client, &request);
+    } else if (header.templateId == BINARY_TEMPLATE_MARKET_DATA_REQUEST && frameSize == sizeof(BinaryMarketDataRequest)) {
+        BinaryMarketDataRequest request;
+        memcpy(&request, frame, sizeof(request));
+        handleBinaryMarketDataRequest(client, &request);
+    } else if (header.templateId == BINARY_TEMPLATE_ORDER_MASS_CANCEL_REQUEST && frameSize == sizeof(BinaryOrderMassCancelRequest)) {
+        BinaryOrderMassCancelRequest request;
+        memcpy(&request, frame, sizeof(request));
+        handleBinaryOrderMassCancelRequest(client, &request);
+    } else if (header.templateId == BINARY_TEMPLATE_TEST_REQUEST && frameSize == sizeof(BinaryTestRequest)) {
+        BinaryTestRequest request;
+        memcpy(&request, frame, sizeof(request));
+        handleBinaryTestRequest(client, &request);
+    } else if (header.templateId == BINARY_TEMPLATE_HEARTBEAT && frameSize == sizeof(BinaryHeartbeat)) {
+        writeLog(client->logFile, "Client heartbeat received.");
+    } else {
+        writeLog(client->logFile, "Invalid binary message type");
+    }
+}
+
+// Size of the frame whose header starts at `frame`, or -1 if its blockLength
+// is longer than any template we accept.
+ssize_t binaryFrameSize(const char* frame) {
+    BinaryHeader header;
+    memcpy(&header, frame, sizeof(header));
+    if (header.blockLength > MAX_BINARY_FRAME_SIZE - sizeof(BinaryHeader)) {
+        return -1;
+    }
+    return (ssize_t)sizeof(BinaryHeader) + header.blockLength;
+}
+
+// Tops the session's partial frame up to `wanted` bytes from this read.
+ssize_t fillPendingFrame(ClientInfo* client, const char* message, ssize_t length, ssize_t offset, ssize_t wanted) {
+    ssize_t count = wanted - client->pendingLength;
+    if (count <= 0) {
+        return offset;
+    }
+    if (count > length - offset) {
+        count = length - offset;
+    }
+    memcpy(client->pendingInput + client->pendingLength, message + offset, count);
+    client->pendingLength += (int)count;
+    return offset + count;
+}
+
+// TCP is a byte stream, so a frame may straddle reads and one read may carry
+// several frames. A frame is dispatched only once all of its header and
+// blockLength bytes are in; a partial tail waits in the session for the next
+// read. An oversized blockLength means we have lost framing, so the
+// connection is dropped rather than resynchronised.
+void handleBinaryMessage(ClientInfo* client, const char* message, ssize_t length) {
+    ssize_t offset = 0;
+    ssize_t frameSize;
+    if (client->pendingLength > 0) {
+        offset = fillPendingFrame(client, message, length, offset, sizeof(BinaryHeader));
+        if (client->pendingLength < (int)sizeof(BinaryHeader)) {
+            return;
         }
-        prevOrder = currentOrder;
-        currentOrder = currentOrder->next;
+        frameSize = binaryFrameSize(client->pendingInput);
+        if (frameSize < 0) {
+            writeLog(client->logFile, "Oversized binary frame, closing connection");
+            closeClient(client);
+            return;
+        }
+        offset = fillPendingFrame(client, message, length, offset, frameSize);
+        if (client->pendingLength < frameSize) {
+            return;
+        }
+        client->pendingLength = 0;
+        dispatchBinaryFrame(client, client->pendingInput, frameSize);
     }
 
-    // Remove from market data
-    for (int i = 0; i < marketDataCount; i++) {
-        if (strcmp(marketDataList[i].instrument, clOrdId) == 0) {
-            // Shift all elements down
-            for (int j = i; j < marketDataCount - 1; j++) {
-                marketDataList[j] = marketDataList[j + 1];
-            }
-            (marketDataCount)--;
+    while (length - offset >= (ssize_t)sizeof(BinaryHeader)) {
+        frameSize = binaryFrameSize(message + offset);
+        if (frameSize < 0) {
+            writeLog(client->logFile, "Oversized binary frame, closing connection");
+            closeClient(client);
+            return;
+        }
+        if (length - offset < frameSize) {
             break;
         }
+        dispatchBinaryFrame(client, message + offset, frameSize);
+        offset += frameSize;
     }
 
-    // Send response to client
-    sprintf(buffer, "Order with ClOrdID=%s has been cancelled.", clOrdId);
-    ssize_t bytesSent = send(clientSocket, buffer, strlen(buffer), 0);
-    if (bytesSent < 0) {
-        perror("Error in sending data");
-        exit(EXIT_FAILURE);
-    }
+    memcpy(client->pendingInput, message + offset, length - offset);
+    client->pendingLength = (int)(length - offset);
 }
+
 void handleClientMessage(ClientInfo* client, const char* message, int clientSocket, char* buffer) {
     char msgType[20];
     sscanf(message, "CompID=%*[^|]|ServerSeqNum=%*d|ClientSeqNum=%*d|MsgType=%[^|]|",
            msgType);
 
     if (strcmp(msgType, "NewOrderSingle") == 0) {
-        NewOrderSingle order;
+        NewOrderSingle order = {0};
         parseNewOrderSingle(message, &order);
-        order.clientId = client->clientId;  
-        handleNewOrderSingle(client, &order, client->logFile, &buyOrders, &sellOrders, &serverSeqNum);
-
-        sprintf(buffer, "Received order: %s,%s,%s,%d,%.2f",
-            order.clOrdId, order.instrument, order.side, order.quantity, order.price);
-        ssize_t bytesSent = send(clientSocket, buffer, strlen(buffer), 0);
-        if (bytesSent < 0) {
-            perror("Error in sending data");
-            exit(EXIT_FAILURE);
+        order.sessionId = client->sessionId;
+
+        const char* rejectReason = order.side != SIDE_BUY && order.side != SIDE_SELL ?
+                                   "Invalid side" : checkOrderRisk(client, &order);
+        if (rejectReason != NULL) {
+            writeLog(client->logFile, rejectReason);
+            sprintf(buffer, "CompID=SERVER|ServerSeqNum=%d|ClientSeqNum=%d|MsgType=8|ClOrdID=%s|OrdStatus=8|Text=%s|",
+                    client->nextOutSeqNum++, client->lastSeqNum, order.clOrdId, rejectReason);
+        } else {
+            handleNewOrderSingle(client, &order, client->logFile, &buyOrders, &sellOrders);
+
+            sprintf(buffer, "Received order: %s,%s,%s,%d,%.2f",
+                order.clOrdId, order.instrument, sideName(order.side), order.quantity, order.price);
         }
+        sendToClient(clientSocket, buffer, strlen(buffer));
     } else if (strcmp(msgType, "Logon") == 0) {
-        handleLogon(client, clientSocket, buffer);
+        handleLogon(message, clientSocket, buffer);
     } else if (strcmp(msgType, "TestRequest") == 0) {
         handleTestRequest(client, clientSocket, buffer);
     } else if (strcmp(msgType, "ResendRequest") == 0) {
         handleResendRequest(client, message, clientSocket);
     } else if (strcmp(msgType, "OrderCancelRequest") == 0) {
         handleOrderCancelRequest(client, message, clientSocket, buffer);
+    } else if (strcmp(msgType, "q") == 0) {
+        handleOrderMassCancelRequest(client, message, clientSocket, buffer);
     } else if (strcmp(msgType, "V") == 0) {
-        handleMarketDataRequest(client, buffer, clientSocket, buffer);
+        handleMarketDataRequest(client, message, clientSocket, buffer);
     } else {
         writeLog(client->logFile, "Invalid message type");
         fflush(client->logFile);
     }
 }
 
-void handleClient(int clientId) {
+// One write(2) per record, unbuffered, so a crash or kill loses at most the
+// record being written and never a tail of them.
+void writeCaptureRecord(int clientSocket, const char* message, ssize_t length) {
+    char record[sizeof(CaptureRecord) + BUFFER_SIZE];
+    CaptureRecord header = { messageReceiveTime, clientSocket, (uint32_t)length };
+    memcpy(record, &header, sizeof(header));
+    memcpy(record + sizeof(header), message, length);
+    if (write(captureFd, record, sizeof(header) + length) < 0) {
+        perror("Cannot write capture record");
+    }
+}
+
+// Everything after the socket read: shared by the live session thread and
+// the replay loop so both drive exactly the same code. length 0 is a disconnect.
+void processClientMessage(int clientId, char* message, ssize_t length) {
     char buffer[BUFFER_SIZE];
+    if (clientId < 0 || clientId >= MAX_FDS) {
+        return;
+    }
+    ClientInfo* client = sessionByFd[clientId];
+    if (length == 0) {
+        if (client != NULL) {
+            closeClient(client);
+        } else {
+            printf("Client disconnected\n");
+            releaseSocket(clientId);
+        }
+        return;
+    }
+
+    memset(buffer, 0, sizeof(buffer));
+    if (client == NULL) {
+        // Nothing but a Logon is accepted until the connection is bound to a session
+        char msgType[20];
+        message[length] = '\0';
+        if (sscanf(message, "CompID=%*[^|]|ServerSeqNum=%*d|ClientSeqNum=%*d|MsgType=%19[^|]|", msgType) == 1 &&
+            strcmp(msgType, "Logon") == 0) {
+            handleLogon(message, clientId, buffer);
+        } else {
+            // No session yet, so the reject is unsequenced
+            strcpy(buffer, "CompID=SERVER|ServerSeqNum=0|ClientSeqNum=0|MsgType=3|Text=Logon required|");
+            sendToClient(clientId, buffer, strlen(buffer));
+        }
+        return;
+    }
+
+    // Logon is always tag=value; only after it negotiates BINARY do frames change.
+    if (client->encoding == ENCODING_BINARY) {
+        handleBinaryMessage(client, message, length);
+        return;
+    }
+    message[length] = '\0'; // assuming it's a text message
+
+    handleClientMessage(client, message, clientId, buffer);
+}
+
+void handleClient(int clientId) {
     char message[BUFFER_SIZE];
-    ClientInfo* client = NULL;
+    ssize_t n = read(clientId, message, sizeof(message) - 1);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return;
+    }
+    if (n < 0) {
+        perror("Read error");
+        n = 0;
+    }
+    messageReceiveTime = monotonicNanos();
 
-    char fileName[20];
-    snprintf(fileName, sizeof(fileName), "%d.txt", clientId);
-    FILE* fp = fopen(fileName, "w");
-    if (fp == NULL) {
-        perror("Error in opening file");
-        exit(EXIT_FAILURE);
+    if (captureFd >= 0) {
+        writeCaptureRecord(clientId, message, n);
+    }
+    processClientMessage(clientId, message, n);
+}
+
+// Compares the replay output against a golden run record by record, so a
+// matcher change that alters any fill, reject or sequence number shows up.
+int compareWithGolden(FILE* output, const char* goldenPath) {
+    FILE* golden = fopen(goldenPath, "rb");
+    if (golden == NULL) {
+        perror("Cannot open golden file");
+        return 0;
     }
-    client->logFile = fp;
-    client->clientId = clientId;
-    client->lastSeqNum = 0;
+    rewind(output);
+
+    long recordIndex = 0;
+    int matches = 1;
     while (1) {
-        memset(buffer, 0, sizeof(buffer));
-        ssize_t n = read(clientId, message, sizeof(message) - 1);
-        if (n < 0) {
-            perror("Read error");
-            exit(EXIT_FAILURE);
-        } else if (n == 0) {
-            printf("Client disconnected\n");
-            exit(EXIT_SUCCESS);
+        CaptureRecord expected, actual;
+        char expectedData[BUFFER_SIZE], actualData[BUFFER_SIZE];
+        size_t expectedRead = fread(&expected, sizeof(expected), 1, golden);
+        size_t actualRead = fread(&actual, sizeof(actual), 1, output);
+        if (expectedRead == 0 && actualRead == 0) {
+            break;
         }
-        message[n] = '\0'; // assuming it's a text message
+        if (expectedRead != actualRead || expected.sessionId != actual.sessionId ||
+            expected.length != actual.length || expected.length > sizeof(expectedData) ||
+            fread(expectedData, 1, expected.length, golden) != expected.length ||
+            fread(actualData, 1, actual.length, output) != actual.length ||
+            memcmp(expectedData, actualData, expected.length) != 0) {
+            printf("Replay diverges from golden run at output message %ld.\n", recordIndex);
+            matches = 0;
+            break;
+        }
+        recordIndex++;
+    }
+    if (matches) {
+        printf("Replay matches golden run (%ld output messages).\n", recordIndex);
+    }
+    fclose(golden);
+    return matches;
+}
 
-        if (client == NULL) {
-            for (int i = 0; i < clientCount; i++) {
-                if (clientList[i].clientId == clientId) {
-                    client = &clientList[i];
-                    break;
-                }
-            }
-            if (client == NULL) {
-                if (clientCount >= MAX_PENDING_REQUESTS) {
-                    printf("Maximum number of clients exceeded.\n");
-                    return;
-                }
-                client = &clientList[clientCount++];
+// Feeds a capture through processClientMessage either as fast as possible or
+// at the captured inter-arrival times, then reports throughput.
+int runReplay(void) {
+    FILE* capture = fopen(serverConfig.replayPath, "rb");
+    if (capture == NULL) {
+        perror("Cannot open capture file");
+        return EXIT_FAILURE;
+    }
+    replayOutputFile = serverConfig.replayOutputPath != NULL ? fopen(serverConfig.replayOutputPath, "w+b") : tmpfile();
+    if (replayOutputFile == NULL) {
+        perror("Cannot open replay output file");
+        return EXIT_FAILURE;
+    }
+    replayMode = 1;
+
+    pinCurrentThread(serverConfig.sessionCore, "replay");
+    initOrderPool();
+
+    char message[BUFFER_SIZE];
+    CaptureRecord record;
+    long messageCount = 0;
+    long long firstReceiveTime = 0;
+    long long replayStart = monotonicNanos();
+    while (fread(&record, sizeof(record), 1, capture) == 1) {
+        if (record.length >= sizeof(message) || fread(message, 1, record.length, capture) != record.length) {
+            printf("Corrupt capture record %ld.\n", messageCount);
+            break;
+        }
+        if (messageCount == 0) {
+            firstReceiveTime = record.receiveTime;
+        }
+        if (serverConfig.replayPacing) {
+            long long due = replayStart + (record.receiveTime - firstReceiveTime);
+            while (monotonicNanos() < due) {
             }
         }
 
-        handleClientMessage(client, message, clientId, buffer);
+        messageReceiveTime = record.receiveTime;
+        processClientMessage(record.sessionId, message, record.length);
+        messageCount++;
+    }
+    long long elapsed = monotonicNanos() - replayStart;
+    fclose(capture);
+
+    printf("Replayed %ld messages in %.3f ms (%.0f ns/message).\n", messageCount,
+           elapsed / 1e6, messageCount > 0 ? (double)elapsed / messageCount : 0.0);
+
+    int matches = 1;
+    fflush(replayOutputFile);
+    if (serverConfig.goldenPath != NULL) {
+        matches = compareWithGolden(replayOutputFile, serverConfig.goldenPath);
+    }
+    fclose(replayOutputFile);
+    return matches ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// All sessions and the order book are owned by this one thread, so matching
+// needs no locks. With busy-spin the thread never sleeps in epoll_wait;
+// otherwise it wakes at least once a second to adopt reloaded risk limits
+// and to notice shutdown.
+void* runSessionThread(void* arg) {
+    pinCurrentThread(serverConfig.sessionCore, "session");
+    initOrderPool();
+
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    int timeout = serverConfig.busySpin ? 0 : 1000;
+    while (!atomic_load_explicit(&shutdownRequested, memory_order_relaxed)) {
+        int eventCount = epoll_wait(epollFd, events, MAX_EPOLL_EVENTS, timeout);
+        if (eventCount < 0 && errno != EINTR) {
+            perror("epoll_wait error");
+            exit(EXIT_FAILURE);
+        }
+
+        if (atomic_load_explicit(&pendingRiskLimits, memory_order_relaxed) != NULL) {
+            adoptRiskLimits(atomic_exchange(&pendingRiskLimits, NULL));
+        }
+
+        for (int i = 0; i < eventCount; i++) {
+            handleClient(events[i].data.fd);
+        }
+    }
+    return NULL;
+}
+
+void configureClientSocket(int clientSocket) {
+    if (fcntl(clientSocket, F_SETFL, fcntl(clientSocket, F_GETFL) | O_NONBLOCK) < 0) {
+        perror("Cannot make client socket non-blocking");
+    }
+    if (serverConfig.tcpNoDelay) {
+        int enable = 1;
+        if (setsockopt(clientSocket, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable)) < 0) {
+            perror("Cannot set TCP_NODELAY");
+        }
+    }
+    if (serverConfig.busyPollUsec > 0) {
+        if (setsockopt(clientSocket, SOL_SOCKET, SO_BUSY_POLL, &serverConfig.busyPollUsec, sizeof(serverConfig.busyPollUsec)) < 0) {
+            perror("Cannot set SO_BUSY_POLL");
+        }
+    }
+}
+
+void parseServerOptions(int argc, char *argv[]) {
+    int option;
+    while ((option = getopt(argc, argv, "c:a:snp:dw:r:Po:g:")) != -1) {
+        if (option == 'c') {
+            serverConfig.sessionCore = atoi(optarg);
+        } else if (option == 'a') {
+            serverConfig.acceptorCore = atoi(optarg);
+        } else if (option == 's') {
+            serverConfig.busySpin = 1;
+        } else if (option == 'n') {
+            serverConfig.tcpNoDelay = 1;
+        } else if (option == 'p') {
+            serverConfig.busyPollUsec = atoi(optarg);
+        } else if (option == 'd') {
+            serverConfig.cancelOnDisconnect = 1;
+        } else if (option == 'w') {
+            serverConfig.capturePath = optarg;
+        } else if (option == 'r') {
+            serverConfig.replayPath = optarg;
+        } else if (option == 'P') {
+            serverConfig.replayPacing = 1;
+        } else if (option == 'o') {
+            serverConfig.replayOutputPath = optarg;
+        } else if (option == 'g') {
+            serverConfig.goldenPath = optarg;
+        } else {
+            fprintf(stderr, "Usage: %s [-c sessionCore] [-a acceptorCore] [-s] [-n] [-p busyPollUsec] [-d] [-w capture]\n"
+                            "       %s -r capture [-P] [-o output] [-g golden] [-c core] [-d]\n"
+                            "  -s  busy-spin instead of blocking in epoll_wait\n"
+                            "  -n  set TCP_NODELAY on client sockets\n"
+                            "  -p  set SO_BUSY_POLL (microseconds) on client sockets\n"
+                            "  -d  cancel a session's orders when it disconnects, unless its Logon sets CancelOnDisconnect=N\n"
+                            "  -w  record every inbound message to a capture file; risk.conf reloads and -d\n"
+                            "      are not recorded, so replay with the same risk.conf and -d as the capture\n"
+                            "  -r  replay a capture instead of listening; -P keeps the original pacing\n"
+                            "  -o  write what the server sent during replay (use as a later golden file)\n"
+                            "  -g  compare replay output with a golden run, exit 1 on any difference\n",
+                    argv[0], argv[0]);
+            exit(EXIT_FAILURE);
+        }
     }
-    fclose(fp);
 }
 
 int main(int argc, char *argv[]) {
@@ -402,6 +1632,27 @@ int main(int argc, char *argv[]) {
     socklen_t clientAddressLength = sizeof(clientAddress);
     int clientSocket;
 
+    parseServerOptions(argc, argv);
+
+    // Nothing else is running yet, so the startup table is adopted right here
+    RiskLimits* limits = loadRiskLimits(RISK_CONFIG_FILE);
+    if (limits == NULL) {
+        return EXIT_FAILURE;
+    }
+    adoptRiskLimits(limits);
+
+    if (serverConfig.replayPath != NULL) {
+        return runReplay();
+    }
+
+    if (serverConfig.capturePath != NULL) {
+        captureFd = open(serverConfig.capturePath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (captureFd < 0) {
+            perror("Cannot open capture file");
+            return EXIT_FAILURE;
+        }
+    }
+
     serverSocket = socket(AF_INET, SOCK_STREAM, 0);
     if (serverSocket < 0) {
         perror("Cannot open socket");
@@ -420,23 +1671,92 @@ int main(int argc, char *argv[]) {
 
     listen(serverSocket, MAX_PENDING_REQUESTS);
 
-    signal(SIGINT, handleInterrupt);
+    // SIGINT/SIGTERM stop the server and SIGHUP reloads the limits. All three
+    // are blocked before any thread starts, so no handler ever interrupts the
+    // session thread: shutdown is read from a signalfd in the accept loop
+    // below, and the reload thread sigwaits for SIGHUP.
+    sigset_t blockedSignals, shutdownSignals;
+    sigemptyset(&shutdownSignals);
+    sigaddset(&shutdownSignals, SIGINT);
+    sigaddset(&shutdownSignals, SIGTERM);
+    blockedSignals = shutdownSignals;
+    sigaddset(&blockedSignals, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &blockedSignals, NULL);
+    int signalFd = signalfd(-1, &shutdownSignals, SFD_CLOEXEC);
+    if (signalFd < 0) {
+        perror("Cannot create signalfd");
+        return EXIT_FAILURE;
+    }
+
+    pthread_t reloadThread;
+    if (pthread_create(&reloadThread, NULL, runRiskReloadThread, NULL) != 0) {
+        perror("Cannot start risk reload thread");
+        return EXIT_FAILURE;
+    }
+
+    epollFd = epoll_create1(0);
+    if (epollFd < 0) {
+        perror("Cannot create epoll instance");
+        return EXIT_FAILURE;
+    }
+
+    pthread_t sessionThread;
+    if (pthread_create(&sessionThread, NULL, runSessionThread, NULL) != 0) {
+        perror("Cannot start session thread");
+        return EXIT_FAILURE;
+    }
+    pinCurrentThread(serverConfig.acceptorCore, "acceptor");
 
+    struct pollfd acceptorFds[2] = { { serverSocket, POLLIN, 0 }, { signalFd, POLLIN, 0 } };
     while (1) {
+        if (poll(acceptorFds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll error");
+            break;
+        }
+        if (acceptorFds[1].revents & POLLIN) {
+            struct signalfd_siginfo signalInfo;
+            if (read(signalFd, &signalInfo, sizeof(signalInfo)) == sizeof(signalInfo)) {
+                printf("Shutting down on signal %u.\n", signalInfo.ssi_signo);
+            }
+            break;
+        }
+        if (!(acceptorFds[0].revents & POLLIN)) {
+            continue;
+        }
+
         clientSocket = accept(serverSocket, (struct sockaddr*)&clientAddress, &clientAddressLength);
         if (clientSocket < 0) {
             perror("Cannot accept client");
-            return EXIT_FAILURE;
+            // The connection stays queued while we are out of descriptors, so
+            // retrying at once would only spin on the same error
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                usleep(ACCEPT_BACKOFF_USEC);
+            }
+            continue;
+        }
+
+        if (clientSocket >= MAX_FDS) {
+            printf("Maximum number of clients exceeded.\n");
+            close(clientSocket);
+            continue;
         }
+        configureClientSocket(clientSocket);
 
-        if (fork() == 0) {  // Child process
-            close(serverSocket);
-            handleClient(clientSocket);
-            exit(EXIT_SUCCESS);
-        } else {  // Parent process
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN;
+        event.data.fd = clientSocket;
+        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, clientSocket, &event) < 0) {
+            perror("Cannot register client");
             close(clientSocket);
         }
     }
 
+    atomic_store(&shutdownRequested, 1);
+    pthread_join(sessionThread, NULL);
+    shutdownServer();
     return EXIT_SUCCESS;
 }